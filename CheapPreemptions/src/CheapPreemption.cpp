@@ -3,6 +3,8 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/LoopInfo.h"
@@ -18,11 +20,19 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -89,6 +99,8 @@ std::map<std::pair<const BasicBlock *, const BasicBlock *>, BasicBlock *> Update
 std::map<std::pair<const BasicBlock *, const BasicBlock *>, Value *> LoopInductionVariableMap; 
 std::map<std::pair<const BasicBlock *, const BasicBlock *>, int> LoopDepthMap; 
 std::map<std::pair<const BasicBlock *, const BasicBlock *>, SmallVector<BasicBlock*, 32> *> LoopExitBlocks;
+// outermost loop -> budget (in cost units) its budgeted probes count down before reading the clock
+std::map<const Loop *, Value *> NestBudgetMap;
 
 // list of functions in call graph order (reversed topolically sorted)
 SmallVector<StringRef, 128> CGOrderedFunc;
@@ -102,6 +114,10 @@ LLVMContext *LLVMCtx;
 DominatorTree *DT;
 LoopInfo *LI;
 ScalarEvolution *SE;
+// only with -profile-guided
+BlockFrequencyInfo *BFI;
+// the current function has profile data and -profile-guided is set
+bool UseProfile;
 
 // fix this later
 const BasicBlock* LargeBB;
@@ -246,20 +262,44 @@ static cl::opt<bool> WillUpdateLastCycleTS(
         "Choose whether to define clock in the pass. true: Yes, false: No"),
     cl::value_desc("true/false"), cl::init(false), cl::Optional);
 
+static cl::opt<bool> ProfileGuided(
+	"profile-guided",
+	cl::desc("Place probes by the block frequencies of functions with profile data (clang -fprofile-instr-use)"),
+	cl::init(false), cl::Optional);
+
+static cl::opt<bool> BudgetLoopProbes(
+	"budget-loop-probes",
+	cl::desc("Probes inside instrumented loops count down an iteration budget and only read the clock once it runs out"),
+	cl::init(true), cl::Optional);
+
+static cl::opt<GlobalValue::ThreadLocalMode> CITLSModel(
+	"ci-tls-model",
+	cl::desc("TLS model of the CI globals the probes access (local-exec only for those defined in the module)"),
+	cl::values(clEnumValN(GlobalValue::GeneralDynamicTLSModel, "general-dynamic", "any link (default)"),
+			   clEnumValN(GlobalValue::InitialExecTLSModel, "initial-exec", "executables and libraries loaded at startup"),
+			   clEnumValN(GlobalValue::LocalExecTLSModel, "local-exec", "non-PIC executables")),
+	cl::init(GlobalValue::GeneralDynamicTLSModel), cl::Optional);
+
+static cl::opt<bool> CacheCITLSAddrs(
+	"cache-ci-tls",
+	cl::desc("Compute the addresses of the CI globals once in the entry of functions with several probes"),
+	cl::init(true), cl::Optional);
+
+static cl::opt<bool> DeferToLink(
+	"cheap-preempt-defer",
+	cl::desc("Only mark the functions of the module, probes are placed at the -flto link"),
+	cl::init(false), cl::Optional);
+
+// function attribute: "defer" until the link places the probes, "done" after
+static const char *const InstrAttr = "cheap-preempt";
+
 /*********** Section: CheapPreemption pass ***********/
 
-struct CheapPreemption : public ModulePass {
-  static char ID;
-  CheapPreemption() : ModulePass(ID) {}
-
-  void getAnalysisUsage(AnalysisUsage &AU) const override {
-  	AU.addRequired<CallGraphWrapperPass>();
-	AU.addRequired<LoopInfoWrapperPass>();
-	// AU.addRequired<PostDominatorTreeWrapperPass>();
-	AU.addRequired<DominatorTreeWrapperPass>();
-	// AU.addRequired<MemoryDependenceWrapperPass>();
-	AU.addRequired<ScalarEvolutionWrapperPass>();
-  }
+/* run by either pass manager, which provide the analyses */
+struct CheapPreemption {
+  CallGraph *CG;
+  // sets DT, LI and SE for a function
+  std::function<void(Function &)> GetFuncAnalyses;
 
   void generateTopoSort(Function &F) {
 	TopoSorter TS;
@@ -508,27 +548,181 @@ struct CheapPreemption : public ModulePass {
 	return std::make_pair(MaxBB, MaxDist);
   }
 
+  uint64_t getEdgeFreq(const BasicBlock *From, const BasicBlock *To) {
+	return (BFI->getBlockFreq(From) * BFI->getBPI()->getEdgeProbability(From, To)).getFrequency();
+  }
+
   bool decideInstLocations(std::map<const BasicBlock *, int> &DistanceMap, std::map<const BasicBlock *, const BasicBlock *> &PrevBBMap, const BasicBlock* MaxBB, int DistThreshold) {
 	const BasicBlock* CurBB = MaxBB;
+	// the last edge of the path within the threshold, or with a profile, the coldest one
+	// that still leaves at least half of the threshold before it
+	std::pair<const BasicBlock *, const BasicBlock *> InstEdge(nullptr, nullptr);
+	uint64_t InstEdgeFreq = 0;
 	while(true)
 	{
 		const BasicBlock* PrevBB = PrevBBMap[CurBB];
-		if(DistanceMap[PrevBB] < DistThreshold) {
-			assert(EdgeInstMap[std::make_pair(PrevBB, CurBB)] == UNINST);
-			EdgeInstMap[std::make_pair(PrevBB, CurBB)] = NORM_INST;
-			// double check that the PrevBB is not instrumented
-			assert(InstrumentedBB.find(PrevBB) == InstrumentedBB.end());
-			// errs() << "Instrument Edge\n";
-			NumEdgeInst++;
-			return true;
-		}
 		if(PrevBB == CurBB) {
-			LargeBB = CurBB;
+			if(!InstEdge.first)
+				LargeBB = CurBB;
 			break;
 		}
+		if(DistanceMap[PrevBB] < DistThreshold) {
+			if(!UseProfile) {
+				InstEdge = std::make_pair(PrevBB, CurBB);
+				break;
+			}
+			if(InstEdge.first && DistanceMap[PrevBB] < DistThreshold / 2)
+				break;
+			uint64_t Freq = getEdgeFreq(PrevBB, CurBB);
+			if(!InstEdge.first || Freq < InstEdgeFreq) {
+				InstEdge = std::make_pair(PrevBB, CurBB);
+				InstEdgeFreq = Freq;
+			}
+		}
 		CurBB = PrevBB;
 	}
-	return false;
+	if(!InstEdge.first)
+		return false;
+	assert(EdgeInstMap[InstEdge] == UNINST);
+	EdgeInstMap[InstEdge] = NORM_INST;
+	// double check that the PrevBB is not instrumented
+	assert(InstrumentedBB.find(InstEdge.first) == InstrumentedBB.end());
+	// errs() << "Instrument Edge\n";
+	NumEdgeInst++;
+	return true;
+  }
+
+  /* drop the hottest edge probes first, as long as the longest paths stay within what they were */
+  void pruneHotProbes(Function &F, int E2EThreshold) {
+	std::vector<std::pair<uint64_t, std::pair<const BasicBlock *, const BasicBlock *>>> ProbedEdges;
+	for(auto it = EdgeInstMap.begin(); it != EdgeInstMap.end(); ++it) {
+		if(it->second == NORM_INST)
+			ProbedEdges.push_back(std::make_pair(getEdgeFreq(it->first.first, it->first.second), it->first));
+	}
+	std::sort(ProbedEdges.begin(), ProbedEdges.end(), [](const auto &A, const auto &B) { return A.first > B.first; });
+
+	std::map<const BasicBlock *, int> DistanceMap;
+	std::map<const BasicBlock *, const BasicBlock *> PrevBBMap;
+	int MaxDist = std::max(int(CommitInterval), generateDistanceMap(F, DistanceMap, PrevBBMap).second);
+	int MaxE2EDist = std::max(E2EThreshold, getMaxE2EDistance(F));
+	int NumPruned = 0;
+	for(auto &ProbedEdge : ProbedEdges) {
+		EdgeInstMap[ProbedEdge.second] = UNINST;
+		DistanceMap.clear();
+		PrevBBMap.clear();
+		if(generateDistanceMap(F, DistanceMap, PrevBBMap).second <= MaxDist && getMaxE2EDistance(F) <= MaxE2EDist) {
+			NumEdgeInst--;
+			NumPruned++;
+			continue;
+		}
+		EdgeInstMap[ProbedEdge.second] = NORM_INST;
+	}
+	if(NumPruned > 0)
+		errs() << F.getName() << ": " << NumPruned << " hot edge probes pruned\n";
+  }
+
+  /*
+   * a loop's probe checks the clock every CommitInterval/cost iterations; with a
+   * profile, probe the cold edges on its longest iteration instead, so that the
+   * iterations that actually run set that cost
+   */
+  void probeColdLoopPaths(Function &F) {
+	for(auto backEdge : backEdges) {
+		Loop *L = LI->getLoopFor(backEdge.second);
+		if(!L || L->getHeader() != backEdge.second)
+			continue;
+		uint64_t HeaderFreq = BFI->getBlockFreq(backEdge.second).getFrequency();
+		while(true) {
+			std::map<const BasicBlock *, int> LongestDistanceMap;
+			std::map<const BasicBlock *, const BasicBlock *> PrevBBMap;
+			longestDistanceFrom(backEdge.second, LongestDistanceMap, &PrevBBMap);
+			int LongestCost = LongestDistanceMap[backEdge.first];
+			if(LongestCost == 0 || getExpectedLoopCost(backEdge) >= LongestCost / 2)
+				break;
+			// an edge is cold if it is taken in less than 1/16 of the iterations
+			std::pair<const BasicBlock *, const BasicBlock *> ColdEdge(nullptr, nullptr);
+			uint64_t ColdFreq = HeaderFreq / 16;
+			for(const BasicBlock *CurBB = backEdge.first; PrevBBMap[CurBB] != CurBB; CurBB = PrevBBMap[CurBB]) {
+				uint64_t Freq = getEdgeFreq(PrevBBMap[CurBB], CurBB);
+				if(Freq < ColdFreq) {
+					ColdEdge = std::make_pair(PrevBBMap[CurBB], CurBB);
+					ColdFreq = Freq;
+				}
+			}
+			if(!ColdEdge.first)
+				break;
+			EdgeInstMap[ColdEdge] = NORM_INST;
+			NumEdgeInst++;
+		}
+	}
+  }
+
+  /* profile-weighted cost of an iteration, -1 without a loop or frequencies for it */
+  int getExpectedLoopCost(std::pair<const BasicBlock *, const BasicBlock *> BackEdge) {
+	Loop *L = LI->getLoopFor(BackEdge.second);
+	if(!L || L->getHeader() != BackEdge.second)
+		return -1;
+	uint64_t HeaderFreq = BFI->getBlockFreq(BackEdge.second).getFrequency();
+	if(HeaderFreq == 0)
+		return -1;
+	double Cost = 0;
+	for(BasicBlock *BB : L->blocks()) {
+		if(CostMap[BB] <= 0)
+			continue;
+		// inner loops count once per iteration, as on the longest path
+		double Ratio = double(BFI->getBlockFreq(BB).getFrequency()) / HeaderFreq;
+		Cost += CostMap[BB] * std::min(Ratio, 1.0);
+	}
+	return int(Cost);
+  }
+
+  /* the -ci-tls-model of a CI global, never weaker than what it already has */
+  void setCITLSModel(GlobalVariable *GV) {
+	GlobalValue::ThreadLocalMode Mode = CITLSModel;
+	// local-exec only reaches variables of the executable itself
+	if(Mode == GlobalValue::LocalExecTLSModel && GV->isDeclaration())
+		Mode = GlobalValue::InitialExecTLSModel;
+	if(Mode > GV->getThreadLocalMode())
+		GV->setThreadLocalMode(Mode);
+  }
+
+  /*
+   * Each access to a TLS global computes its address again in every block it
+   * is in (a __tls_get_addr call for general-dynamic, a GOT load for
+   * initial-exec). With several probes, compute it once in the entry and let
+   * the probes share it. The empty asm keeps the backend from folding the
+   * address back into each access.
+   */
+  void cacheCITLSAddrs(Function &F) {
+	if(!CacheCITLSAddrs || ProbeIdx < 2)
+		return;
+	Module *M = F.getParent();
+	Instruction *InsertPoint = nullptr;
+	for(Instruction &Inst : F.getEntryBlock()) {
+		if(isa<AllocaInst>(&Inst) || isa<DbgInfoIntrinsic>(&Inst) || isa<PHINode>(&Inst))
+			continue;
+		InsertPoint = &Inst;
+		break;
+	}
+	IRBuilder<> IR(InsertPoint);
+	for(const char *Name : {"LastCycleTS", "ci_cycles_threshold", "intvActionHook"}) {
+		GlobalVariable *GV = M->getGlobalVariable(Name);
+		// a local-exec access is a single %fs-relative instruction already
+		if(!GV || GV->getThreadLocalMode() == GlobalValue::LocalExecTLSModel)
+			continue;
+		SmallVector<Use *, 16> ProbeUses;
+		for(Use &U : GV->uses()) {
+			Instruction *UseInst = dyn_cast<Instruction>(U.getUser());
+			if(UseInst && UseInst->getFunction() == &F)
+				ProbeUses.push_back(&U);
+		}
+		if(ProbeUses.empty())
+			continue;
+		InlineAsm *Opaque = InlineAsm::get(FunctionType::get(GV->getType(), {GV->getType()}, false), "", "=r,0", false);
+		Value *Addr = IR.CreateCall(Opaque, {GV}, GV->getName() + ".addr");
+		for(Use *U : ProbeUses)
+			U->set(Addr);
+	}
   }
 
   /* CI function prototype */
@@ -546,7 +740,7 @@ struct CheapPreemption : public ModulePass {
 		funcName, PointerType::getUnqual(
 					  FunctionType::get(Builder.getVoidTy(), funcArgs, false)));
 	GlobalVariable *gCIFuncPtr = static_cast<GlobalVariable *>(funcPtr);
-	gCIFuncPtr->setThreadLocalMode(GlobalValue::GeneralDynamicTLSModel);
+	setCITLSModel(gCIFuncPtr);
 	assert(funcPtr && "Could not find CI handler function!");
 
 	return funcPtr;
@@ -654,16 +848,16 @@ struct CheapPreemption : public ModulePass {
 		IR.CreateStore(getConstInteger(&IR, LoopIterations, 0), LoopIterations);
 	if(LoopThreshold) {
 		assert(!LoopIterations);
-		LoadInst *Loopiter = IR.CreateLoad(LoopThreshold, "NextThreshold");
+		LoadInst *Loopiter = IR.CreateLoad(LoopThreshold->getType()->getPointerElementType(), LoopThreshold, "NextThreshold");
 		Value *Inc = IR.CreateAdd(Loopiter, getConstInteger(&IR, LoopThreshold, IncrementBy));
 		IR.CreateStore(Inc, LoopThreshold);
 	}
 	CallInst *now = IR.CreateIntrinsic(Intrinsic::readcyclecounter, {}, {}, nullptr, "currCycle");
 	GlobalVariable *thenVar = F->getParent()->getGlobalVariable("LastCycleTS");
-	LoadInst *then = IR.CreateLoad(thenVar, "lastCycle");
+	LoadInst *then = IR.CreateLoad(thenVar->getType()->getPointerElementType(), thenVar, "lastCycle");
 	Value *timeDiff = IR.CreateSub(now, then, "elapsedCycles");
 	Value *ci_cycles_threshold = I.getModule()->getGlobalVariable("ci_cycles_threshold");
-	Value *targetinterval = IR.CreateLoad(ci_cycles_threshold, "targetInCycle"); // CYCLES
+	Value *targetinterval = IR.CreateLoad(ci_cycles_threshold->getType()->getPointerElementType(), ci_cycles_threshold, "targetInCycle"); // CYCLES
 	if (timeDiff->getType() != targetinterval->getType()) {
 		errs() << "Wrongful loaded LC type: " << *timeDiff->getType() << "\n";
 		timeDiff = IR.CreateZExt(timeDiff, targetinterval->getType(), "zeroExtendSLI");
@@ -678,16 +872,113 @@ struct CheapPreemption : public ModulePass {
 	pushToMLCfromTLLC(ti, now, timeDiff);
   }
 
+  /* longest iteration of L through From->To (From == To for a block), whatever the probes on the way */
+  int longestIterationThrough(Loop *L, const BasicBlock *From, const BasicBlock *To) {
+	std::map<const BasicBlock *, int> FromHeader, ToLatch;
+	FromHeader[L->getHeader()] = std::max(CostMap[L->getHeader()], 0);
+	for (BBVector::const_reverse_iterator RI = SortedBBs.rbegin(), RE = SortedBBs.rend(); RI != RE; ++RI) {
+		if(FromHeader.find(*RI) == FromHeader.end())
+			continue;
+		const Instruction *TInst = (*RI)->getTerminator();
+		for (unsigned I = 0, NSucc = TInst->getNumSuccessors(); I < NSucc; ++I) {
+			const BasicBlock *Succ = TInst->getSuccessor(I);
+			// back edges of L and of its inner loops
+			if(!L->contains(Succ) || DT->dominates(Succ, *RI))
+				continue;
+			FromHeader[Succ] = std::max(FromHeader[Succ], FromHeader[*RI] + std::max(CostMap[Succ], 0));
+		}
+	}
+	ToLatch[L->getLoopLatch()] = std::max(CostMap[L->getLoopLatch()], 0);
+	for (auto BB : SortedBBs) {
+		if(!L->contains(BB))
+			continue;
+		const Instruction *TInst = BB->getTerminator();
+		for (unsigned I = 0, NSucc = TInst->getNumSuccessors(); I < NSucc; ++I) {
+			const BasicBlock *Succ = TInst->getSuccessor(I);
+			if(!L->contains(Succ) || DT->dominates(Succ, BB) || ToLatch.find(Succ) == ToLatch.end())
+				continue;
+			ToLatch[BB] = std::max(ToLatch[BB], std::max(CostMap[BB], 0) + ToLatch[Succ]);
+		}
+	}
+	if(FromHeader.find(From) == FromHeader.end() || ToLatch.find(To) == ToLatch.end())
+		return 0;
+	if(From == To)
+		return FromHeader[From] + ToLatch[To] - std::max(CostMap[From], 0);
+	return FromHeader[From] + ToLatch[To];
+  }
+
+  /* what a probe on From->To charges to its loop nest budget per pass, 0 if it reads the clock every time */
+  int getBudgetIterCost(const BasicBlock *From, const BasicBlock *To) {
+	if(!BudgetLoopProbes)
+		return 0;
+	Loop *L = LI->getLoopFor(From);
+	if(!L || !L->contains(To) || !L->getLoopLatch())
+		return 0;
+	// the back edge probe covers the iterations that skip this probe
+	if(EdgeInstMap[std::make_pair(L->getLoopLatch(), L->getHeader())] != LOOP_INST)
+		return 0;
+	int IterCost = longestIterationThrough(L, From, To);
+	// not worth it if the budget runs out every other iteration
+	if(IterCost <= 0 || CommitInterval / IterCost < 2)
+		return 0;
+	return IterCost;
+  }
+
+  /* one budget shared by the whole loop nest, reset when the nest is entered */
+  Value *getNestBudget(Function &F, const BasicBlock *BB) {
+	Loop *L = LI->getLoopFor(BB);
+	while(L->getParentLoop())
+		L = L->getParentLoop();
+	auto found = NestBudgetMap.find(L);
+	if(found != NestBudgetMap.end())
+		return found->second;
+	Instruction *AllocaInsertPoint = nullptr;
+	for(Instruction &Inst : F.getEntryBlock()) {
+		if(isa<AllocaInst>(&Inst) || isa<DbgInfoIntrinsic>(&Inst) || isa<PHINode>(&Inst))
+			continue;
+		AllocaInsertPoint = &Inst;
+		break;
+	}
+	IRBuilder<> AllocaBuilder(AllocaInsertPoint);
+	Value *Budget = AllocaBuilder.CreateAlloca(AllocaBuilder.getInt32Ty(), 0, "LoopNestBudget");
+	AllocaBuilder.CreateStore(AllocaBuilder.getInt32(0), Budget);
+	// an exhausted budget on entry: the first probe of the nest reads the clock
+	auto PreHeaderFound = PreheaderMap.find(std::make_pair(L->getLoopLatch(), L->getHeader()));
+	if(L->getLoopLatch() && PreHeaderFound != PreheaderMap.end()) {
+		IRBuilder<> IR(PreHeaderFound->second->getTerminator());
+		IR.CreateStore(IR.getInt32(0), Budget);
+	}
+	NestBudgetMap[L] = Budget;
+	return Budget;
+  }
+
+  /* charge an iteration to the nest budget and only read the clock once it is used up */
+  void insertBudgetedCycleProbe(Instruction &I, Value *Budget, int IterCost) {
+	IRBuilder<> IR(&I);
+	LoadInst *BudgetLeft = IR.CreateLoad(IR.getInt32Ty(), Budget, "BudgetLeft");
+	Value *Dec = IR.CreateSub(BudgetLeft, IR.getInt32(IterCost));
+	IR.CreateStore(Dec, Budget);
+	Value *condition = IR.CreateICmpSLE(Dec, IR.getInt32(0), "budgetSpent");
+	Instruction *ti = llvm::SplitBlockAndInsertIfThen(condition, &I, false);
+	Function::iterator blockItr(ti->getParent());
+	blockItr++;
+	blockItr->setName("postBudget");
+	IR.SetInsertPoint(ti);
+	IR.CreateStore(IR.getInt32(CommitInterval), Budget);
+	insertCycleProbe(*ti);
+  }
+
   void insertRecursionProbe(Function &F, Instruction &I, int NumIters) {
   	Module *M = F.getParent();
   	auto InitVal32 = llvm::ConstantInt::get(M->getContext(), llvm::APInt(32, 0, false));
   	GlobalVariable *RecursionVariable = new GlobalVariable(*M, Type::getInt32Ty(M->getContext()), false,
 					   GlobalValue::ExternalLinkage, InitVal32, "RecursionVariable");
   	RecursionVariable->setThreadLocalMode(GlobalValue::GeneralDynamicTLSModel);
+  	setCITLSModel(RecursionVariable);
 
   	// then instrument loop edge
 	IRBuilder<> IR(&I);
-	LoadInst *RecursionIterator = IR.CreateLoad(RecursionVariable, "RecursionIterator");
+	LoadInst *RecursionIterator = IR.CreateLoad(RecursionVariable->getType()->getPointerElementType(), RecursionVariable, "RecursionIterator");
 	Value *Inc = IR.CreateAdd(RecursionIterator, IR.getInt32(1));
 	IR.CreateStore(Inc, RecursionVariable);
 	Value *condition = IR.CreateICmpEQ(Inc, IR.getInt32(NumIters), "commit");
@@ -778,7 +1069,7 @@ struct CheapPreemption : public ModulePass {
 		}
 		// then instrument loop edge
 		IRBuilder<> IR(&I);
-		LoadInst *Loopiter = IR.CreateLoad(LoopIterations, "LoopIterations");
+		LoadInst *Loopiter = IR.CreateLoad(LoopIterations->getType()->getPointerElementType(), LoopIterations, "LoopIterations");
 		Value *Inc = IR.CreateAdd(Loopiter, IR.getInt32(1));
 		IR.CreateStore(Inc, LoopIterations);
 		Value *condition = IR.CreateICmpEQ(Inc, IR.getInt32(NumIters), "commit");
@@ -806,7 +1097,7 @@ struct CheapPreemption : public ModulePass {
 			if(IsNested) {
 				assert(ResidualSteps);
 				int InitialConstValue = dyn_cast<ConstantInt>(InitialValue)->getSExtValue();
-				LoadInst *LoopInst = InitializeBuilder.CreateLoad(ResidualSteps, "CurrResidualSteps");
+				LoadInst *LoopInst = InitializeBuilder.CreateLoad(ResidualSteps->getType()->getPointerElementType(), ResidualSteps, "CurrResidualSteps");
 				Value *Inc = InitializeBuilder.CreateAdd(LoopInst, getConstInteger(&InitializeBuilder, StepInst, InitialConstValue));
 				InitializeBuilder.CreateStore(Inc, LoopThreshold);
 			} else {
@@ -818,7 +1109,7 @@ struct CheapPreemption : public ModulePass {
 		} else {
 			if(IsNested) {
 				assert(ResidualSteps);
-				LoadInst *LoopInst = InitializeBuilder.CreateLoad(ResidualSteps, "CurrResidualSteps");
+				LoadInst *LoopInst = InitializeBuilder.CreateLoad(ResidualSteps->getType()->getPointerElementType(), ResidualSteps, "CurrResidualSteps");
 				Value *Inc = InitializeBuilder.CreateAdd(LoopInst, InitialValue);
 				InitializeBuilder.CreateStore(Inc, LoopThreshold);						
 			}
@@ -854,7 +1145,7 @@ struct CheapPreemption : public ModulePass {
 
 		// then instrument loop edge
 		IRBuilder<> IR(&I);
-		LoadInst *LoopInst = IR.CreateLoad(LoopThreshold, "CurrThreshold");
+		LoadInst *LoopInst = IR.CreateLoad(LoopThreshold->getType()->getPointerElementType(), LoopThreshold, "CurrThreshold");
 		
 		if (LoopInst->getType() != StepInst->getType()) {
 			errs() << "Wrongful loaded LC type: " << *LoopInst->getType() << " " << *StepInst->getType() << "\n";
@@ -879,7 +1170,7 @@ struct CheapPreemption : public ModulePass {
 			}
 			for(auto BB : *LoopExitBlocks[std::make_pair(LatchBB, HeaderBB)]) {
 				IRBuilder<> IR(BB->getTerminator());
-				LoadInst *LoopInst = IR.CreateLoad(LoopThreshold, "FinalThreshold");
+				LoadInst *LoopInst = IR.CreateLoad(LoopThreshold->getType()->getPointerElementType(), LoopThreshold, "FinalThreshold");
 				Value *RemainigSteps = IR.CreateSub(LoopInst, IndVar);
 				IR.CreateStore(RemainigSteps, ResidualSteps);
 				IR.SetInsertPoint(BB->getTerminator());
@@ -1068,7 +1359,7 @@ struct CheapPreemption : public ModulePass {
 
 		// check SumLoopVal
 		IRBuilder<> IR(SplittedBB->getTerminator());
-		LoadInst *Loopiter = IR.CreateLoad(SumLoopVal, "CurrSumLoopVal");
+		LoadInst *Loopiter = IR.CreateLoad(SumLoopVal->getType()->getPointerElementType(), SumLoopVal, "CurrSumLoopVal");
 		Value *Total = IR.CreateAdd(Loopiter, ValRange);
 		IR.CreateStore(Total, SumLoopVal);
 		if(StepValue > 0)
@@ -1174,6 +1465,10 @@ struct CheapPreemption : public ModulePass {
 		std::map<const BasicBlock *, int> LongestDistanceMap;
 		longestDistanceFrom(backEdge.second, LongestDistanceMap);
 		LoopCost[backEdge] = LongestDistanceMap[backEdge.first];
+		// with a profile, what an iteration costs on average, but at least half of
+		// the longest one to bound the overshoot
+		if(UseProfile && LoopCost[backEdge] > 0 && getExpectedLoopCost(backEdge) >= 0)
+			LoopCost[backEdge] = std::max(std::min(getExpectedLoopCost(backEdge), LoopCost[backEdge]), std::max(LoopCost[backEdge] / 2, 1));
 		if(LoopCost[backEdge] > CommitInterval)
 			errs() << "LoopCost: " << LoopCost[backEdge] << "\n";
 
@@ -1193,6 +1488,15 @@ struct CheapPreemption : public ModulePass {
 		}
 	} 
 
+	// probes inside loops charge their longest iteration to the nest budget; decided before the CFG changes
+	std::map<std::pair<const BasicBlock *, const BasicBlock *>, int> BudgetIterCost;
+	for(auto it = EdgeInstMap.begin(); it != EdgeInstMap.end(); ++it) {
+		if(it->second == NORM_INST)
+			BudgetIterCost[it->first] = getBudgetIterCost(it->first.first, it->first.second);
+	}
+	for(auto BB : InstrumentedBB)
+		BudgetIterCost[std::make_pair(BB, BB)] = getBudgetIterCost(BB, BB);
+
 	// first, instrument normal edges
 	for(auto it = EdgeInstMap.begin(); it != EdgeInstMap.end(); ++it) {
 		if(it->second == UNINST)
@@ -1200,8 +1504,13 @@ struct CheapPreemption : public ModulePass {
 		if(it->second == NORM_INST) {
 			BasicBlock* FromBB = const_cast<BasicBlock*>(it->first.first);
 			BasicBlock* ToBB = const_cast<BasicBlock*>(it->first.second);
+			int IterCost = BudgetIterCost[it->first];
+			Value *Budget = IterCost > 0 ? getNestBudget(F, FromBB) : nullptr;
 			BasicBlock* SplittedBB = llvm::SplitEdge(FromBB, ToBB, nullptr, nullptr, nullptr, "SplittedEdge");
-			insertCycleProbe(*SplittedBB->getTerminator());
+			if(Budget)
+				insertBudgetedCycleProbe(*SplittedBB->getTerminator(), Budget, IterCost);
+			else
+				insertCycleProbe(*SplittedBB->getTerminator());
 			auto found = PreheaderMap.find(std::make_pair(ToBB, ToBB));
 			if(found != PreheaderMap.end() && found->second == FromBB)
 			{
@@ -1218,6 +1527,8 @@ struct CheapPreemption : public ModulePass {
 			// NumIters = 1;
 			insertRecursionProbe(F, *(const_cast<BasicBlock*>(BB)->getTerminator()), NumIters);
 		}
+		else if(BudgetIterCost[std::make_pair(BB, BB)] > 0)
+			insertBudgetedCycleProbe(*(const_cast<BasicBlock*>(BB)->getTerminator()), getNestBudget(F, BB), BudgetIterCost[std::make_pair(BB, BB)]);
 		else
 			insertCycleProbe(*(const_cast<BasicBlock*>(BB)->getTerminator()));
 	}
@@ -1385,6 +1696,10 @@ struct CheapPreemption : public ModulePass {
 			//return;
 		}
 	}
+	if(UseProfile) {
+		pruneHotProbes(F, E2EThreshold);
+		probeColdLoopPaths(F);
+	}
 	insertProbes(F);
   }
 
@@ -1524,17 +1839,17 @@ struct CheapPreemption : public ModulePass {
 	LoopInductionVariableMap.clear();
 	LoopDepthMap.clear();
 	LoopExitBlocks.clear();
+	NestBudgetMap.clear();
 	NumExtLibInst = 0;
 	NumEdgeInst = 0;
 	NumBBInst = 0;
 	ProbeIdx = 0;
 	LoopCostMode = false;
+	UseProfile = ProfileGuided && F.hasProfileData();
 	std::hash<std::string> hasher;
 	FuncHash = int64_t(hasher(F.getName().str()));
 	LLVMCtx = &F.getContext();
-	DT = &getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
-	LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
-	SE = &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+	GetFuncAnalyses(F);
   }
 
    /* read function call costs to file for CI-compliant libraries */
@@ -1946,6 +2261,23 @@ struct CheapPreemption : public ModulePass {
 	populateEdgeInstMap();
 	generateInst(F);
 	updateFuncInfo(F);
+	cacheCITLSAddrs(F);
+  }
+
+  int getMaxE2EDistance(Function &F) {
+	std::map<const BasicBlock *, int> LongestDistanceMap;
+	int MaxDist = 0;
+	longestDistanceFrom(&F.getEntryBlock(), LongestDistanceMap);
+	for (auto &BB : F) {
+		if(LongestDistanceMap.find(&BB) == LongestDistanceMap.end())
+			continue;
+		if(isa<ReturnInst>(BB.getTerminator()))
+		{
+			if(LongestDistanceMap.find(&BB)->second > MaxDist)
+				MaxDist = LongestDistanceMap.find(&BB)->second;
+		}
+	}
+	return MaxDist;
   }
 
   void updateFuncInfo(Function &F) {
@@ -1961,19 +2293,7 @@ struct CheapPreemption : public ModulePass {
 	FInfo->TotalNumProbe = TotalNumProbe;
 	// errs() << "Ext Lib: " << NumExtLibInst << " BB: " << NumBBInst << " Edge: " << NumEdgeInst << "\n";
 	// obtain longest uninstrumented e2e path
-	std::map<const BasicBlock *, int> LongestDistanceMap;
-	int MaxDist = 0;
-	longestDistanceFrom(&F.getEntryBlock(), LongestDistanceMap);
-	for (auto &BB : F) {
-		if(LongestDistanceMap.find(&BB) == LongestDistanceMap.end())
-			continue;
-		if(isa<ReturnInst>(BB.getTerminator()))
-		{
-			if(LongestDistanceMap.find(&BB)->second > MaxDist)
-				MaxDist = LongestDistanceMap.find(&BB)->second;
-		}
-	}
-	FInfo->MaxUnistDist = MaxDist;
+	FInfo->MaxUnistDist = getMaxE2EDistance(F);
 	for(int64_t i = 0; i < ProbeIdx; i++) 
 		FInfo->ProbeSigs.push_back(FuncHash + i);
 	computedFuncInfo[&F] = FInfo;
@@ -1987,7 +2307,7 @@ struct CheapPreemption : public ModulePass {
 
 	std::error_code EC;
 	sys::fs::remove(OutInfoFilePath);
-	raw_fd_ostream fout(OutInfoFilePath, EC, sys::fs::F_Text);
+	raw_fd_ostream fout(OutInfoFilePath, EC, sys::fs::OF_Text);
 	for (auto &F : M) {
 	  if (F.isDeclaration())
 		continue;
@@ -2016,7 +2336,7 @@ struct CheapPreemption : public ModulePass {
 
 	std::error_code EC;
 	sys::fs::remove(OutCostFilePath);
-	raw_fd_ostream fout(OutCostFilePath, EC, sys::fs::F_Text);
+	raw_fd_ostream fout(OutCostFilePath, EC, sys::fs::OF_Text);
 	fout << "Cost File\n";
 	for (auto &F : M) {
 	  if (F.isDeclaration())
@@ -2083,12 +2403,17 @@ struct CheapPreemption : public ModulePass {
   }
   
   void initializeGlobalVariables(Module &M) {
-	new GlobalVariable(M, Type::getInt64Ty(M.getContext()), false,
-					   GlobalValue::ExternalLinkage, 0, "ci_cycles_threshold",
-					   nullptr, GlobalValue::GeneralDynamicTLSModel, 0, true);
-	new GlobalVariable(M, Type::getInt64Ty(M.getContext()), false,
-					   GlobalValue::ExternalLinkage, 0, "LastCycleTS",
-					   nullptr, GlobalValue::GeneralDynamicTLSModel, 0, true);
+	// after LTO, the program may already declare them through ci_lib.h
+	if (!M.getGlobalVariable("ci_cycles_threshold"))
+		new GlobalVariable(M, Type::getInt64Ty(M.getContext()), false,
+						   GlobalValue::ExternalLinkage, 0, "ci_cycles_threshold",
+						   nullptr, GlobalValue::GeneralDynamicTLSModel, 0, true);
+	if (!M.getGlobalVariable("LastCycleTS"))
+		new GlobalVariable(M, Type::getInt64Ty(M.getContext()), false,
+						   GlobalValue::ExternalLinkage, 0, "LastCycleTS",
+						   nullptr, GlobalValue::GeneralDynamicTLSModel, 0, true);
+	setCITLSModel(M.getGlobalVariable("ci_cycles_threshold"));
+	setCITLSModel(M.getGlobalVariable("LastCycleTS"));
 
 	// added for number of probes
     // new GlobalVariable(M, Type::getInt64Ty(M.getContext()), false,
@@ -2122,8 +2447,7 @@ struct CheapPreemption : public ModulePass {
 
     /* Get the list of functions in module in call graph order */
   void getRecursiveFunc() {
-    CallGraph &CG = getAnalysis<CallGraphWrapperPass>().getCallGraph();
-    for (scc_iterator<CallGraph *> CGI = scc_begin(&CG), CGE = scc_end(&CG); CGI != CGE; ++CGI) {
+    for (scc_iterator<CallGraph *> CGI = scc_begin(CG), CGE = scc_end(CG); CGI != CGE; ++CGI) {
       std::vector<CallGraphNode *> NodeVec = *CGI;
       for (std::vector<CallGraphNode *>::iterator I = NodeVec.begin(),E = NodeVec.end();I != E; ++I) {
         Function *F = (*I)->getFunction();
@@ -2143,6 +2467,10 @@ struct CheapPreemption : public ModulePass {
   }
 
   void initializeModule(Module &M) {
+	// the plugin may run more than once in a process
+	CGOrderedFunc.clear();
+	IsRecursiveFunc.clear();
+	computedFuncInfo.clear();
 	if (!readCost()) {
 		assert("Unable to library's cost configuration file\n");
 		errs() << "Error reading library's cost configuration file\n";
@@ -2163,7 +2491,49 @@ struct CheapPreemption : public ModulePass {
 	initializeGlobalVariables(M);
   }
 
-  bool runOnModule(Module &M) override {
+  /*
+   * Functions of the program that code marked by -cheap-preempt-defer may be
+   * inlined into at the link, e.g. tq_server's coro() that calls
+   * rocksdb_scan(), carry __attribute__((annotate("cheap-preempt"))); they are
+   * marked too, or the inlined loops would lose their probes.
+   */
+  void markAnnotatedFunctions(Module &M) {
+	GlobalVariable *Annotations = M.getGlobalVariable("llvm.global.annotations");
+	if (!Annotations || !Annotations->hasInitializer())
+		return;
+	auto *Entries = dyn_cast<ConstantArray>(Annotations->getInitializer());
+	if (!Entries)
+		return;
+	for (Value *Op : Entries->operands()) {
+		auto *Entry = dyn_cast<ConstantStruct>(Op);
+		if (!Entry || Entry->getNumOperands() < 2)
+			continue;
+		auto *F = dyn_cast<Function>(Entry->getOperand(0)->stripPointerCasts());
+		auto *Str = dyn_cast<GlobalVariable>(Entry->getOperand(1)->stripPointerCasts());
+		if (!F || F->isDeclaration() || F->hasFnAttribute(InstrAttr) || !Str || !Str->hasInitializer())
+			continue;
+		auto *Data = dyn_cast<ConstantDataArray>(Str->getInitializer());
+		if (Data && Data->isCString() && Data->getAsCString() == InstrAttr)
+			F->addFnAttr(InstrAttr, "defer");
+	}
+  }
+
+  /*
+   * Modules with functions marked by -cheap-preempt-defer come from a -flto
+   * link that also has uninstrumented code (e.g. tq_server itself), only the
+   * marked ones get probes there. Unmarked modules are instrumented whole.
+   */
+  bool willInstrument(Function &F, bool Marked) {
+	if (!Marked)
+		return true;
+	return F.getFnAttribute(InstrAttr).getValueAsString() == "defer";
+  }
+
+  bool runOnModule(Module &M) {
+	bool Marked = false;
+	markAnnotatedFunctions(M);
+	for (auto &F : M)
+		Marked |= F.hasFnAttribute(InstrAttr);
 	initializeModule(M);
 	
 	// Temporary hack
@@ -2174,17 +2544,199 @@ struct CheapPreemption : public ModulePass {
 	// }
 
 	for(auto FuncName : CGOrderedFunc) {
+		Function *F = M.getFunction(FuncName);
+		if(!willInstrument(*F, Marked))
+			continue;
 		/* Analyze & instrument */
-		analyzeAndInstrFunc(*M.getFunction(FuncName));
+		analyzeAndInstrFunc(*F);
+		F->addFnAttr(InstrAttr, "done");
 	}
 	writeInfo(M);
 	writeCost(M);
 	return true;
   }
 }; // end of struct CheapPreemption
+
+/*********** Section: Legacy pass manager (opt -load ... -cheap_preempt) ***********/
+
+struct LegacyCheapPreemption : public ModulePass {
+  static char ID;
+  LegacyCheapPreemption() : ModulePass(ID) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+  	AU.addRequired<CallGraphWrapperPass>();
+	AU.addRequired<LoopInfoWrapperPass>();
+	// AU.addRequired<PostDominatorTreeWrapperPass>();
+	AU.addRequired<DominatorTreeWrapperPass>();
+	// AU.addRequired<MemoryDependenceWrapperPass>();
+	AU.addRequired<ScalarEvolutionWrapperPass>();
+	if(ProfileGuided)
+		AU.addRequired<BlockFrequencyInfoWrapperPass>();
+  }
+
+  bool runOnModule(Module &M) override {
+	CheapPreemption CP;
+	CP.CG = &getAnalysis<CallGraphWrapperPass>().getCallGraph();
+	CP.GetFuncAnalyses = [this](Function &F) {
+		DT = &getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+		LI = &getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+		SE = &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+		if(ProfileGuided)
+			BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI();
+	};
+	return CP.runOnModule(M);
+  }
+};
+
+/*********** Section: New pass manager (plugin for opt, clang and lld) ***********/
+
+struct CheapPreemptionPass : PassInfoMixin<CheapPreemptionPass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+	FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+	CheapPreemption CP;
+	CP.CG = &MAM.getResult<CallGraphAnalysis>(M);
+	CP.GetFuncAnalyses = [&FAM](Function &F) {
+		DT = &FAM.getResult<DominatorTreeAnalysis>(F);
+		LI = &FAM.getResult<LoopAnalysis>(F);
+		SE = &FAM.getResult<ScalarEvolutionAnalysis>(F);
+		if(ProfileGuided)
+			BFI = &FAM.getResult<BlockFrequencyAnalysis>(F);
+	};
+	CP.runOnModule(M);
+	return PreservedAnalyses::none();
+  }
+};
+
+/* -cheap-preempt-defer: leave the probes to the link, which sees the whole program */
+struct CheapPreemptionMarkPass : PassInfoMixin<CheapPreemptionMarkPass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+	for (auto &F : M) {
+		if (!F.isDeclaration() && !F.hasFnAttribute(InstrAttr))
+			F.addFnAttr(InstrAttr, "defer");
+	}
+	return PreservedAnalyses::all();
+  }
+};
+
+/* what the .ll flow ran opt for first: promoted allocas, simplified loops, canonical induction variables */
+void addCheapPreemptionPipeline(ModulePassManager &MPM) {
+	FunctionPassManager FPM;
+	FPM.addPass(PromotePass());
+	FPM.addPass(LoopSimplifyPass());
+	FPM.addPass(createFunctionToLoopPassAdaptor(IndVarSimplifyPass()));
+	MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+	MPM.addPass(CheapPreemptionPass());
+}
+
+/*
+ * cheap-preempt<commit-intv=N;...;will-update-last-cycle-ts> takes the
+ * options as parameters, for lld which parses -mllvm before it loads the
+ * plugin: --lto-newpm-passes='lto<O2>,cheap-preempt<...>'
+ */
+bool parseCheapPreemptionParams(StringRef Params) {
+	static const std::pair<StringRef, cl::opt<int> *> IntParams[] = {
+		{"commit-intv", &CommitInterval},
+		{"ext-lib-cost", &ExtLibFuncCost},
+		{"mem-ops-cost", &MemOpsCost},
+		{"fmul-div-cost", &FMulDivCost},
+		{"max-e2e-length", &MaxE2EUninst},
+		{"func-call-threshold", &FuncCallThreshold},
+	};
+	static const std::pair<StringRef, cl::opt<std::string> *> PathParams[] = {
+		{"in-cost-file", &InCostFilePath},
+		{"in-func-inst-file", &InFuncInstFilePath},
+		{"out-cost-file", &OutCostFilePath},
+		{"out-info-file", &OutInfoFilePath},
+	};
+
+	while (!Params.empty()) {
+		StringRef Param, Key, Value;
+		bool Found = false;
+		std::tie(Param, Params) = Params.split(';');
+		std::tie(Key, Value) = Param.split('=');
+		if (Key == "will-update-last-cycle-ts") {
+			WillUpdateLastCycleTS = true;
+			continue;
+		}
+		if (Key == "profile-guided") {
+			ProfileGuided = true;
+			continue;
+		}
+		if (Key == "no-budget-loop-probes") {
+			BudgetLoopProbes = false;
+			continue;
+		}
+		if (Key == "no-cache-ci-tls") {
+			CacheCITLSAddrs = false;
+			continue;
+		}
+		if (Key == "tls-model") {
+			if (Value == "general-dynamic")
+				CITLSModel = GlobalValue::GeneralDynamicTLSModel;
+			else if (Value == "initial-exec")
+				CITLSModel = GlobalValue::InitialExecTLSModel;
+			else if (Value == "local-exec")
+				CITLSModel = GlobalValue::LocalExecTLSModel;
+			else {
+				errs() << "cheap-preempt: unknown tls-model " << Value << "\n";
+				return false;
+			}
+			continue;
+		}
+		for (auto &IP : IntParams) {
+			int N;
+			if (Key != IP.first)
+				continue;
+			if (Value.getAsInteger(0, N)) {
+				errs() << "cheap-preempt: " << Key << " takes an integer\n";
+				return false;
+			}
+			*IP.second = N;
+			Found = true;
+		}
+		for (auto &PP : PathParams) {
+			if (Key != PP.first)
+				continue;
+			*PP.second = Value.str();
+			Found = true;
+		}
+		if (!Found) {
+			errs() << "cheap-preempt: unknown parameter " << Key << "\n";
+			return false;
+		}
+	}
+	return true;
+}
 }  // end of anonymous namespace
 
-char CheapPreemption::ID = 0;
-static RegisterPass<CheapPreemption> X("cheap_preempt", "Cheap Preemption Pass",
+char LegacyCheapPreemption::ID = 0;
+static RegisterPass<LegacyCheapPreemption> X("cheap_preempt", "Cheap Preemption Pass",
 							 false /* Only looks at CFG */,
 							 false /* Analysis Pass */);
+
+/*
+ * opt -load-pass-plugin=CheapPreemption.so -passes=cheap-preempt, or
+ * clang -fpass-plugin=CheapPreemption.so, which runs it (or only marks the
+ * functions, with -cheap-preempt-defer) once the module is optimized
+ */
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+	return {LLVM_PLUGIN_API_VERSION, "CheapPreemption", LLVM_VERSION_STRING, [](PassBuilder &PB) {
+		PB.registerPipelineParsingCallback(
+			[](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+				if (Name.consume_front("cheap-preempt<") && Name.consume_back(">")) {
+					if (!parseCheapPreemptionParams(Name))
+						return false;
+				} else if (Name != "cheap-preempt") {
+					return false;
+				}
+				addCheapPreemptionPipeline(MPM);
+				return true;
+			});
+		PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM, auto Level) {
+			if (DeferToLink)
+				MPM.addPass(CheapPreemptionMarkPass());
+			else
+				addCheapPreemptionPipeline(MPM);
+		});
+	}};
+}
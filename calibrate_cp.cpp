@@ -0,0 +1,401 @@
+/*
+ * Calibrates the cost model of the CheapPreemption pass on this machine.
+ * Microkernels with known numbers of ALU, memory and FMul/FDiv operations are
+ * timed with the TSC. An ALU operation is one unit of the pass, its cycles
+ * come from the ALU-only kernel. A least-squares fit over all kernels then
+ * gives the cycles of the other classes, which set -mem-ops-cost and
+ * -fmul-div-cost. -commit-intv is the probe spacing in cycles (-s) over the
+ * cycles of a unit. External calls that RocksDB makes are timed one by one
+ * and written, in units, to a cost file in the format that -in-cost-file
+ * reads, after the entries of a base cost file (-i). The make variables go to
+ * a file that the Makefiles here and in RocksDB-TQ include.
+ *
+ * usage: ./calibrate_cp [-q quantum cycles] [-s probe spacing cycles]
+ *        [-w working set KB] [-c cpu] [-i base cost file] [-o cost file]
+ *        [-m make file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+#include <new>
+#include <set>
+#include <string>
+#include <vector>
+
+// the Makefile passes its QUANTUM_CYCLE
+#ifndef QUANTUM_CYCLE
+#define QUANTUM_CYCLE 5000
+#endif
+#define DEFAULT_WORKING_SET_KB 1024
+#define DEFAULT_COST_FILE "cp_calibration.cost"
+#define DEFAULT_MAKE_FILE "cp_calibration.mk"
+#define KERNEL_ITERATIONS 20000
+#define CALL_ITERATIONS 20000
+#define TRIALS 20
+#define CACHE_LINE_SIZE 64
+#define NUM_CLASSES 3
+
+static uint64_t rdtsc(){
+    unsigned int lo,hi;
+    __asm__ __volatile__ ("lfence\n\t" "rdtsc": "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Operation groups of the microkernels: two independent ALU chains; two
+ * pointer chases over the working set and a store, as loads outnumber stores
+ * in IR; and FMul/FDiv on two chains, dividing and multiplying by 1.0.
+ */
+#define ALU2 "add $1, %%r8\n\t" "add $1, %%r9\n\t"
+#define MEM3 "mov (%%rsi), %%rsi\n\t" "mov (%%rdi), %%rdi\n\t" "mov %%r8, (%%rdx)\n\t"
+#define FP4 "mulsd %%xmm1, %%xmm0\n\t" "mulsd %%xmm1, %%xmm2\n\t" "divsd %%xmm1, %%xmm0\n\t" "mulsd %%xmm1, %%xmm2\n\t"
+#define REP4(x) x x x x
+#define REP8(x) REP4(x) REP4(x)
+#define REP16(x) REP8(x) REP8(x)
+
+static const double one = 1.0;
+static uint64_t store_slot[CACHE_LINE_SIZE / sizeof(uint64_t)];
+
+#define KERNEL(name, body) \
+static void name(long iters, void *chase0, void *chase1) { \
+	__asm__ __volatile__ ( \
+		"movsd %[one], %%xmm0\n\t" "movsd %[one], %%xmm1\n\t" "movsd %[one], %%xmm2\n\t" \
+		"1:\n\t" body "dec %[n]\n\t" "jnz 1b\n\t" \
+		: [n] "+r" (iters), "+S" (chase0), "+D" (chase1) \
+		: "d" (store_slot), [one] "m" (one) \
+		: "r8", "r9", "xmm0", "xmm1", "xmm2", "memory", "cc"); \
+}
+
+KERNEL(kernel_alu, REP16(ALU2))
+KERNEL(kernel_mem, REP8(MEM3))
+KERNEL(kernel_fp, REP4(FP4))
+KERNEL(kernel_alu_mem, REP8(ALU2 MEM3))
+KERNEL(kernel_alu_fp, REP4(ALU2 ALU2 FP4))
+KERNEL(kernel_mixed, REP4(ALU2 ALU2 MEM3 FP4))
+
+/* operations per iteration, the loop's dec and jnz count as ALU */
+struct kernel {
+	const char *name;
+	void (*run)(long, void *, void *);
+	int ops[NUM_CLASSES];
+};
+
+// ALU first, the fit takes its cycles as given
+enum { ALU, MEM, FP };
+static const char *class_names[NUM_CLASSES] = {"alu", "mem", "fmul/fdiv"};
+
+static const kernel kernels[] = {
+	{"alu", kernel_alu, {34, 0, 0}},
+	{"mem", kernel_mem, {2, 24, 0}},
+	{"fp", kernel_fp, {2, 0, 16}},
+	{"alu+mem", kernel_alu_mem, {18, 24, 0}},
+	{"alu+fp", kernel_alu_fp, {18, 0, 16}},
+	{"mixed", kernel_mixed, {18, 12, 16}},
+};
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/* a random cycle through the cache lines of the working set */
+static void **build_chase(size_t working_set)
+{
+	size_t num_lines = working_set / CACHE_LINE_SIZE;
+	char *buf = (char *)aligned_alloc(CACHE_LINE_SIZE, num_lines * CACHE_LINE_SIZE);
+	std::vector<size_t> order(num_lines);
+
+	for (size_t i = 0; i < num_lines; i++)
+		order[i] = i;
+	for (size_t i = num_lines - 1; i > 0; i--)
+		std::swap(order[i], order[rand() % (i + 1)]);
+	for (size_t i = 0; i < num_lines; i++)
+		*(void **)(buf + order[i] * CACHE_LINE_SIZE) = buf + order[(i + 1) % num_lines] * CACHE_LINE_SIZE;
+	return (void **)(buf + order[0] * CACHE_LINE_SIZE);
+}
+
+/* fewest cycles per iteration over the trials */
+static double time_kernel(const kernel &k, void **chase)
+{
+	// the second chase starts half way around the cycle
+	void *chase1 = chase;
+	uint64_t best = UINT64_MAX;
+
+	for (int n = 0; n < KERNEL_ITERATIONS / 2; n++)
+		chase1 = *(void **)chase1;
+	for (int t = 0; t < TRIALS; t++) {
+		uint64_t start = rdtsc();
+		k.run(KERNEL_ITERATIONS, chase, chase1);
+		best = std::min(best, rdtsc() - start);
+	}
+	return (double)best / KERNEL_ITERATIONS;
+}
+
+/*
+ * Least squares over the kernels for the classes after ALU, whose cycles are
+ * given: an additive fit of all three hides ALU operations behind the latency
+ * of the others. Solves (A^T A) x = A^T y by elimination.
+ */
+static bool fit_classes(const double *cycles, double *class_cycles)
+{
+	const int n = NUM_CLASSES - 1;
+	double m[n][n + 1] = {};
+
+	for (size_t k = 0; k < NUM_KERNELS; k++) {
+		double rest = cycles[k] - kernels[k].ops[ALU] * class_cycles[ALU];
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++)
+				m[i][j] += (double)kernels[k].ops[i + 1] * kernels[k].ops[j + 1];
+			m[i][n] += kernels[k].ops[i + 1] * rest;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		int pivot = i;
+		for (int r = i + 1; r < n; r++) {
+			if (fabs(m[r][i]) > fabs(m[pivot][i]))
+				pivot = r;
+		}
+		if (fabs(m[pivot][i]) < 1e-9)
+			return false;
+		for (int c = 0; c <= n; c++)
+			std::swap(m[i][c], m[pivot][c]);
+		for (int r = 0; r < n; r++) {
+			if (r == i)
+				continue;
+			double f = m[r][i] / m[i][i];
+			for (int c = i; c <= n; c++)
+				m[r][c] -= f * m[i][c];
+		}
+	}
+	for (int i = 0; i < n; i++)
+		class_cycles[i + 1] = m[i][n] / m[i][i];
+	return true;
+}
+
+/*
+ * External calls, through volatile pointers so that the compiler emits real
+ * calls. Names are the symbols in RocksDB's IR.
+ */
+#define SMALL_COPY 64
+#define SMALL_STRING 32
+static void *(*volatile memcpy_fn)(void *, const void *, size_t) = memcpy;
+static void *(*volatile memmove_fn)(void *, const void *, size_t) = memmove;
+static void *(*volatile memset_fn)(void *, int, size_t) = memset;
+static int (*volatile memcmp_fn)(const void *, const void *, size_t) = memcmp;
+static size_t (*volatile strlen_fn)(const char *) = strlen;
+static void *(*volatile malloc_fn)(size_t) = malloc;
+static void (*volatile free_fn)(void *) = free;
+static int (*volatile lock_fn)(pthread_mutex_t *) = pthread_mutex_lock;
+static int (*volatile unlock_fn)(pthread_mutex_t *) = pthread_mutex_unlock;
+
+alignas(CACHE_LINE_SIZE) static char src[2 * SMALL_COPY], dst[2 * SMALL_COPY];
+static void *ptrs[CALL_ITERATIONS];
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void call_memcpy(long n) { for (long i = 0; i < n; i++) memcpy_fn(dst, src, SMALL_COPY); }
+static void call_memmove(long n) { for (long i = 0; i < n; i++) memmove_fn(dst + 1, dst, SMALL_COPY); }
+static void call_memset(long n) { for (long i = 0; i < n; i++) memset_fn(dst, (int)i, SMALL_COPY); }
+static void call_memcmp(long n) { for (long i = 0; i < n; i++) memcmp_fn(dst, src, SMALL_STRING); }
+static void call_strlen(long n) { for (long i = 0; i < n; i++) strlen_fn(src); }
+static void call_malloc(long n) { for (long i = 0; i < n; i++) ptrs[i] = malloc_fn(SMALL_COPY); }
+static void call_free(long n) { for (long i = 0; i < n; i++) free_fn(ptrs[i]); }
+static void call_new(long n) { for (long i = 0; i < n; i++) ptrs[i] = ::operator new(SMALL_COPY); }
+static void call_delete(long n) { for (long i = 0; i < n; i++) ::operator delete(ptrs[i]); }
+static void call_lock(long n) { for (long i = 0; i < n; i++) { lock_fn(&mutex); unlock_fn(&mutex); } }
+
+/* calls that allocate are timed once per trial with their release, which is not counted */
+struct ext_call {
+	const char *symbol;
+	void (*run)(long);
+	void (*release)(long);
+	// calls per iteration of run
+	int calls;
+};
+
+static const ext_call ext_calls[] = {
+	{"memcpy", call_memcpy, nullptr, 1},
+	{"memmove", call_memmove, nullptr, 1},
+	{"memset", call_memset, nullptr, 1},
+	{"memcmp", call_memcmp, nullptr, 1},
+	{"strlen", call_strlen, nullptr, 1},
+	{"malloc", call_malloc, call_free, 1},
+	{"_Znwm", call_new, call_delete, 1},
+	{"pthread_mutex_lock", call_lock, nullptr, 2},
+};
+
+/* fewest cycles per call over the trials */
+static double time_call(const ext_call &c)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int t = 0; t < TRIALS; t++) {
+		uint64_t start = rdtsc();
+		c.run(CALL_ITERATIONS);
+		best = std::min(best, rdtsc() - start);
+		if (c.release)
+			c.release(CALL_ITERATIONS);
+	}
+	return (double)best / CALL_ITERATIONS / c.calls;
+}
+
+/* free and operator delete, timed after the allocations they release */
+static double time_release(void (*alloc)(long), void (*release)(long))
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int t = 0; t < TRIALS; t++) {
+		alloc(CALL_ITERATIONS);
+		uint64_t start = rdtsc();
+		release(CALL_ITERATIONS);
+		best = std::min(best, rdtsc() - start);
+	}
+	return (double)best / CALL_ITERATIONS;
+}
+
+static int to_units(double cycles, double unit_cycles)
+{
+	return std::max(1, (int)lround(cycles / unit_cycles));
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-q quantum cycles] [-s probe spacing cycles] [-w working set KB] [-c cpu]\n"
+	       "       [-i base cost file] [-o cost file (%s)] [-m make file (%s)]\n",
+	       prog, DEFAULT_COST_FILE, DEFAULT_MAKE_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+	long quantum = QUANTUM_CYCLE, spacing = 0, working_set_kb = DEFAULT_WORKING_SET_KB;
+	int cpu = -1, opt;
+	const char *base_path = nullptr, *cost_path = DEFAULT_COST_FILE, *make_path = DEFAULT_MAKE_FILE;
+	double cycles[NUM_KERNELS], class_cycles[NUM_CLASSES];
+	std::vector<std::pair<std::string, int>> call_units;
+	std::set<std::string> calibrated;
+	double ext_sum = 0;
+
+	while ((opt = getopt(argc, argv, "q:s:w:c:i:o:m:h")) != -1) {
+		switch (opt) {
+		case 'q': quantum = atol(optarg); break;
+		case 's': spacing = atol(optarg); break;
+		case 'w': working_set_kb = atol(optarg); break;
+		case 'c': cpu = atoi(optarg); break;
+		case 'i': base_path = optarg; break;
+		case 'o': cost_path = optarg; break;
+		case 'm': make_path = optarg; break;
+		default: usage(argv[0]); return opt == 'h'? 0 : 1;
+		}
+	}
+	// a probe can fire up to a spacing late, a fifth of the quantum by default
+	if (spacing <= 0)
+		spacing = quantum / 5;
+	if (quantum <= 0 || working_set_kb <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+			perror("sched_setaffinity");
+			return 1;
+		}
+	}
+
+	memset(src, 'a', SMALL_STRING);
+	void **chase = build_chase(working_set_kb * 1024);
+	for (size_t k = 0; k < NUM_KERNELS; k++) {
+		cycles[k] = time_kernel(kernels[k], chase);
+		printf("kernel %-8s %8.2f cycles per iteration\n", kernels[k].name, cycles[k]);
+	}
+	// kernels[0] has only ALU operations
+	class_cycles[ALU] = cycles[0] / kernels[0].ops[ALU];
+	if (!fit_classes(cycles, class_cycles)) {
+		printf("the kernels do not determine the class costs\n");
+		return 1;
+	}
+	double unit_cycles = class_cycles[ALU];
+	for (int i = 0; i < NUM_CLASSES; i++)
+		printf("fit %-9s %6.2f cycles, %d units\n", class_names[i], class_cycles[i], to_units(class_cycles[i], unit_cycles));
+	for (size_t k = 0; k < NUM_KERNELS; k++) {
+		double predicted = 0;
+		for (int i = 0; i < NUM_CLASSES; i++)
+			predicted += kernels[k].ops[i] * class_cycles[i];
+		printf("kernel %-8s measured %8.2f, fit %8.2f cycles\n", kernels[k].name, cycles[k], predicted);
+	}
+
+	for (const ext_call &c : ext_calls) {
+		double call_cycles = time_call(c);
+		call_units.push_back(std::make_pair(std::string(c.symbol), to_units(call_cycles, unit_cycles)));
+		printf("call %-20s %8.2f cycles\n", c.symbol, call_cycles);
+		if (c.release) {
+			const char *symbol = (c.run == call_malloc)? "free" : "_ZdlPv";
+			call_cycles = time_release(c.run, c.release);
+			call_units.push_back(std::make_pair(std::string(symbol), to_units(call_cycles, unit_cycles)));
+			printf("call %-20s %8.2f cycles\n", symbol, call_cycles);
+		}
+	}
+	// pthread_mutex_lock was timed with its unlock
+	call_units.push_back(std::make_pair(std::string("pthread_mutex_unlock"), call_units.back().second));
+	for (auto &cu : call_units) {
+		ext_sum += cu.second;
+		calibrated.insert(cu.first);
+	}
+
+	FILE *cost_file = fopen(cost_path, "w");
+	if (!cost_file) {
+		perror(cost_path);
+		return 1;
+	}
+	fprintf(cost_file, "Cost File\n");
+	if (base_path) {
+		FILE *base = fopen(base_path, "r");
+		char line[1024];
+		if (!base) {
+			perror(base_path);
+			return 1;
+		}
+		// skip its "Cost File" line, the calibrated calls replace their entries
+		if (!fgets(line, sizeof(line), base) || strncmp(line, "Cost File", 9) != 0) {
+			printf("%s is not a cost file\n", base_path);
+			return 1;
+		}
+		while (fgets(line, sizeof(line), base)) {
+			char *colon = strrchr(line, ':');
+			if (!colon || calibrated.count(std::string(line, colon - line)))
+				continue;
+			fputs(line, cost_file);
+		}
+		fclose(base);
+	}
+	for (auto &cu : call_units)
+		fprintf(cost_file, "%s:%d\n", cu.first.c_str(), cu.second);
+	fclose(cost_file);
+
+	int commit_intv = std::max(1, (int)(spacing / unit_cycles));
+	char cost_realpath[PATH_MAX];
+	if (!realpath(cost_path, cost_realpath)) {
+		perror(cost_path);
+		return 1;
+	}
+	FILE *make_file = fopen(make_path, "w");
+	if (!make_file) {
+		perror(make_path);
+		return 1;
+	}
+	fprintf(make_file, "# written by calibrate_cp for a %ld-cycle quantum, probes about %ld cycles apart\n", quantum, spacing);
+	fprintf(make_file, "CMT_INTV = %d\n", commit_intv);
+	fprintf(make_file, "MAX_E2E = %d\n", commit_intv / 2);
+	// unknown external calls cost what the measured ones do on average
+	fprintf(make_file, "EXT_COST = %d\n", (int)lround(ext_sum / call_units.size()));
+	fprintf(make_file, "MEM_COST = %d\n", to_units(class_cycles[MEM], unit_cycles));
+	fprintf(make_file, "FMUL_COST = %d\n", to_units(class_cycles[FP], unit_cycles));
+	fprintf(make_file, "CP_COST_FILE = %s\n", cost_realpath);
+	fclose(make_file);
+	printf("%.2f cycles per unit, commit interval %d units; wrote %s and %s\n", unit_cycles, commit_intv, cost_path, make_path);
+	return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef CORO_SWITCH_H
+#define CORO_SWITCH_H
+
+/*
+ * Minimal x86-64 context switch of the worker coroutines, shared by tq_server
+ * and profile_switch. Only the registers the SysV ABI makes callee-saved are
+ * kept: rbx, rbp and r12-r15 are pushed on the stack being left, whose stack
+ * pointer goes to *from, and popped from the one switched to. Everything else
+ * is dead across a call anyway, preemption included since the CI handler is
+ * reached through a plain call. Nothing changes the MXCSR or x87 control
+ * words, so those are not saved either.
+ *
+ * The symbols are global, include this in one translation unit per binary.
+ */
+
+#include <stdint.h>
+
+extern "C" void coro_switch(void **from, void *to);
+extern "C" void coro_entry(void);
+
+__asm__(
+	".text\n"
+	".globl coro_switch\n"
+	".type coro_switch, @function\n"
+	".p2align 4\n"
+	"coro_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	// a ret would go somewhere else than its call, and miss the return stack buffer
+	"	popq %rcx\n"
+	"	jmp *%rcx\n"
+	".size coro_switch, .-coro_switch\n"
+	// first switch to a coroutine, see coro_init()
+	".globl coro_entry\n"
+	".type coro_entry, @function\n"
+	"coro_entry:\n"
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	// the coroutine function must never return
+	"	ud2\n"
+	".size coro_entry, .-coro_entry\n"
+);
+
+/*
+ * Stack pointer of a coroutine that starts fn(arg) the first time it is
+ * switched to, on the stack that ends at top. The frame is what coro_switch
+ * pops: six registers, with fn and arg in r12 and r13, and coro_entry as the
+ * return address. rbp is 0 to end backtraces there.
+ */
+static inline void *coro_init(char *top, void (*fn)(void *), void *arg)
+{
+	// 16-byte aligned once coro_entry is popped, as a call expects
+	uint64_t *sp = (uint64_t *)((uintptr_t)top & ~(uintptr_t)15) - 2;
+
+	*--sp = (uint64_t)coro_entry;
+	*--sp = 0;              // rbp
+	*--sp = 0;              // rbx
+	*--sp = (uint64_t)fn;   // r12
+	*--sp = (uint64_t)arg;  // r13
+	*--sp = 0;              // r14
+	*--sp = 0;              // r15
+	return sp;
+}
+
+#endif /* CORO_SWITCH_H */
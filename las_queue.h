@@ -0,0 +1,73 @@
+#ifndef LAS_QUEUE_H
+#define LAS_QUEUE_H
+
+/*
+ * Least-attained-service run queue with O(1) push and pop-min, shared by
+ * tq_server and profile_las. Jobs are bucketed by num_quanta: one bucket per
+ * value below LAS_EXACT_BUCKETS, one per power of two above, FIFO within a
+ * bucket. A bitmap of the non-empty buckets finds the minimum with one ctz.
+ * Links are intrusive (T::las_next), nothing is allocated.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LAS_NUM_BUCKETS 64
+#define LAS_EXACT_BUCKETS 48
+// log2 of LAS_EXACT_BUCKETS rounded down, the first power-of-two bucket
+#define LAS_EXACT_BITS 5
+
+static inline uint32_t las_bucket(uint32_t num_quanta)
+{
+	uint32_t b;
+
+	if (num_quanta < LAS_EXACT_BUCKETS)
+		return num_quanta;
+	b = LAS_EXACT_BUCKETS + (31 - __builtin_clz(num_quanta)) - LAS_EXACT_BITS;
+	return (b < LAS_NUM_BUCKETS)? b : LAS_NUM_BUCKETS - 1;
+}
+
+template <class T>
+struct las_queue {
+	T *heads[LAS_NUM_BUCKETS];
+	T *tails[LAS_NUM_BUCKETS];
+	// bit b set if bucket b is not empty
+	uint64_t nonempty;
+	size_t num_jobs;
+
+	las_queue() : nonempty(0), num_jobs(0) {
+		for (int b = 0; b < LAS_NUM_BUCKETS; b++)
+			heads[b] = tails[b] = nullptr;
+	}
+	bool empty() const { return num_jobs == 0; }
+	size_t size() const { return num_jobs; }
+	void push(T *c) {
+		uint32_t b = las_bucket(c->num_quanta);
+		c->las_next = nullptr;
+		if (tails[b] != nullptr)
+			tails[b]->las_next = c;
+		else
+			heads[b] = c;
+		tails[b] = c;
+		nonempty |= 1ULL << b;
+		num_jobs++;
+	}
+	// least serviced job, nullptr if empty
+	T *min() const {
+		return nonempty? heads[__builtin_ctzll(nonempty)] : nullptr;
+	}
+	// must not be empty
+	T *pop() {
+		uint32_t b = __builtin_ctzll(nonempty);
+		T *c = heads[b];
+		heads[b] = c->las_next;
+		if (heads[b] == nullptr) {
+			tails[b] = nullptr;
+			nonempty &= ~(1ULL << b);
+		}
+		num_jobs--;
+		return c;
+	}
+};
+
+#endif /* LAS_QUEUE_H */
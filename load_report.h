@@ -0,0 +1,132 @@
+#ifndef LOAD_REPORT_H
+#define LOAD_REPORT_H
+
+/*
+ * Load reports of the workers to their dispatcher, and the argmin the
+ * dispatcher picks the least loaded worker with. Shared by tq_server and
+ * profile_dispatch.
+ *
+ * A report is 16 bytes, so the reports of four workers share a cache line
+ * and a dispatcher reads all of its workers in a few loads. Each report is a
+ * seqlock: seq is odd while its worker writes it, and readers retry until
+ * they see the same even seq before and after reading the fields.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <immintrin.h>
+#include <algorithm>
+
+// argmin reads keys this many at a time, pad arrays to a multiple of it
+#define LOAD_SCAN_WIDTH 8
+// key of the padding, never picked
+#define LOAD_KEY_MAX INT32_MAX
+// larger backlogs all rank the same, a packed MSQ key stays below LOAD_KEY_MAX
+#define LOAD_BACKLOG_MAX 32766
+
+struct load_report {
+	uint32_t seq;
+	// jobs completed, wraps around
+	uint32_t completed;
+	// quanta serviced of the jobs in progress
+	uint32_t sq;
+	// coroutines the worker runs jobs on
+	uint32_t coros;
+};
+static_assert(sizeof(struct load_report) == 16, "four load reports must fill a cache line");
+
+/* only the owning worker writes its report */
+static inline void load_report_publish(struct load_report *r, uint32_t completed, uint32_t sq, uint32_t coros)
+{
+	uint32_t seq = r->seq;
+
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&r->completed, completed, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->sq, sq, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->coros, coros, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline void load_report_read(const struct load_report *r, struct load_report *out)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		out->completed = __atomic_load_n(&r->completed, __ATOMIC_RELAXED);
+		out->sq = __atomic_load_n(&r->sq, __ATOMIC_RELAXED);
+		out->coros = __atomic_load_n(&r->coros, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&r->seq, __ATOMIC_RELAXED));
+	out->seq = seq;
+}
+
+static inline size_t load_scan_size(size_t n)
+{
+	return (n + LOAD_SCAN_WIDTH - 1) / LOAD_SCAN_WIDTH * LOAD_SCAN_WIDTH;
+}
+
+/*
+ * Index of the smallest of n keys, the first one on ties. n is a non-zero
+ * multiple of LOAD_SCAN_WIDTH. One pass finds the minimum, a second one
+ * stops at the first vector that holds it.
+ */
+static inline size_t load_argmin(const int32_t *keys, size_t n)
+{
+#if defined(__AVX2__)
+	__m256i min = _mm256_loadu_si256((const __m256i *) keys), m;
+	size_t i;
+	uint32_t mask;
+
+	for (i = LOAD_SCAN_WIDTH; i < n; i += LOAD_SCAN_WIDTH)
+		min = _mm256_min_epi32(min, _mm256_loadu_si256((const __m256i *) &keys[i]));
+	// fold the eight lanes, every lane ends up holding the minimum
+	min = _mm256_min_epi32(min, _mm256_permute2x128_si256(min, min, 1));
+	min = _mm256_min_epi32(min, _mm256_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2)));
+	min = _mm256_min_epi32(min, _mm256_shuffle_epi32(min, _MM_SHUFFLE(2, 3, 0, 1)));
+	for (i = 0; ; i += LOAD_SCAN_WIDTH) {
+		m = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) &keys[i]), min);
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__SSE4_1__)
+	__m128i min = _mm_loadu_si128((const __m128i *) keys), m;
+	size_t i;
+	uint32_t mask;
+
+	for (i = 4; i < n; i += 4)
+		min = _mm_min_epi32(min, _mm_loadu_si128((const __m128i *) &keys[i]));
+	min = _mm_min_epi32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2)));
+	min = _mm_min_epi32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(2, 3, 0, 1)));
+	for (i = 0; ; i += 4) {
+		m = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) &keys[i]), min);
+		mask = _mm_movemask_ps(_mm_castsi128_ps(m));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#else
+	size_t best = 0;
+
+	for (size_t i = 1; i < n; i++) {
+		if (keys[i] < keys[best])
+			best = i;
+	}
+	return best;
+#endif
+}
+
+/*
+ * MSQ key of a worker: the backlog in the upper half and the serviced
+ * quanta, capped and complemented, in the lower half, so that on equal
+ * backlogs the worker with the most serviced quanta is the smallest, as in
+ * the heap comparator of MSQ
+ */
+static inline int32_t load_msq_key(int backlog, int sq)
+{
+	backlog = std::max(-LOAD_BACKLOG_MAX, std::min(backlog, LOAD_BACKLOG_MAX));
+	return backlog * 65536 + (65535 - std::min(sq, 65535));
+}
+
+#endif /* LOAD_REPORT_H */
@@ -0,0 +1,311 @@
+/*
+ * Cycles per dispatcher round (check-in of all workers, then spreading a
+ * burst over them) with the versioned-heap MSQ of tq_server vs. the packed
+ * seqlock reports and SIMD argmin of load_report.h, at 16 to 64 workers.
+ *
+ * Also checks that a burst is admitted again once saturated workers drain.
+ *
+ * usage: ./profile_dispatch [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "load_report.h"
+
+#define DEFAULT_ROUNDS 1000000
+#define NUM_COROS 8
+// same as in tq_server
+#define MAX_DISPATCH_UNIT 4
+#define CACHE_LINE_SIZE 64
+// --admit-max-queue of check_admission
+#define ADMIT_MAX_QUEUE 16
+
+/* the per-worker state of a dispatcher, as in tq_server */
+struct worker {
+	int version_number;
+	int num_running_jobs;
+	int serviced_quanta;
+	int num_coros;
+	uint32_t prev_completed;
+};
+
+/* the per-worker line tq_server used to poll */
+struct cache_filled_size {
+	uint64_t size;
+	uint64_t sq;
+	uint64_t coros;
+	char cache_line_filler[CACHE_LINE_SIZE - 3 * sizeof(uint64_t)];
+};
+
+static uint64_t rdtsc(){
+    unsigned int lo,hi;
+    __asm__ __volatile__ ("lfence\n\t" "rdtsc": "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint32_t xorshift32(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static inline int backlog(const worker *w) {
+	return w->num_running_jobs - w->num_coros;
+}
+
+static bool worker_ptr_cmp(const worker *lhs, const worker *rhs) {
+	if(lhs->version_number != rhs->version_number)
+		return lhs->version_number > rhs->version_number;
+	if(backlog(lhs) == backlog(rhs))
+		return lhs->serviced_quanta < rhs->serviced_quanta;
+	return backlog(lhs) > backlog(rhs); // so that it's a min heap
+}
+
+static inline int32_t msq_key(const worker *w) {
+	return load_msq_key(backlog(w), w->serviced_quanta);
+}
+
+/* the workers complete some of their jobs between two rounds, off the clock */
+static void run_workers(std::vector<worker> &ws, uint32_t *seed, uint64_t *completed)
+{
+	for (size_t i = 0; i < ws.size(); i++) {
+		uint32_t running = ws[i].num_running_jobs - (completed[i] - ws[i].prev_completed);
+		completed[i] += running? xorshift32(seed) % (running + 1) : 0;
+	}
+}
+
+static uint64_t run_heap(int n, long rounds, uint64_t *checksum, uint64_t *num_pkts)
+{
+	std::vector<worker> ws(n);
+	std::vector<worker *> heap;
+	std::vector<cache_filled_size> sizes(n);
+	std::vector<uint64_t> completed(n, 0);
+	uint32_t seed = 1;
+	uint64_t cycles = 0, start, sum = 0, pkts = 0;
+
+	for (auto &w : ws) {
+		w = {0, 0, 0, NUM_COROS, 0};
+		heap.push_back(&w);
+	}
+	std::make_heap(heap.begin(), heap.end(), worker_ptr_cmp);
+	for (long r = 0; r < rounds; r++) {
+		run_workers(ws, &seed, completed.data());
+		for (int i = 0; i < n; i++) {
+			sizes[i].size = completed[i];
+			sizes[i].sq = completed[i] & 63;
+			sizes[i].coros = NUM_COROS;
+		}
+		uint32_t nb = xorshift32(&seed) % (n * MAX_DISPATCH_UNIT) + 1;
+		pkts += nb;
+
+		start = rdtsc();
+		for (int i = 0; i < n; i++) {
+			worker *w = &ws[i];
+			w->num_running_jobs -= sizes[i].size - w->prev_completed;
+			w->prev_completed = sizes[i].size;
+			w->serviced_quanta = sizes[i].sq;
+			w->num_coros = sizes[i].coros;
+			w->version_number++;
+		}
+		std::make_heap(heap.begin(), heap.end(), worker_ptr_cmp);
+		uint32_t unit = (nb + n - 1) / n;
+		for (uint32_t i = 0; i < nb; i += unit) {
+			std::pop_heap(heap.begin(), heap.end(), worker_ptr_cmp);
+			worker *w = heap.back();
+			heap.pop_back();
+			w->num_running_jobs += std::min(unit, nb - i);
+			sum += w - ws.data();
+			heap.push_back(w);
+			std::push_heap(heap.begin(), heap.end(), worker_ptr_cmp);
+		}
+		cycles += rdtsc() - start;
+	}
+	*checksum = sum;
+	*num_pkts = pkts;
+	return cycles;
+}
+
+static uint64_t run_scan(int n, long rounds, uint64_t *checksum, uint64_t *num_pkts)
+{
+	std::vector<worker> ws(n);
+	std::vector<int32_t> keys(load_scan_size(n), LOAD_KEY_MAX);
+	std::vector<load_report> reports(n);
+	std::vector<uint64_t> completed(n, 0);
+	struct load_report report;
+	uint32_t seed = 1;
+	uint64_t cycles = 0, start, sum = 0, pkts = 0;
+
+	for (auto &w : ws)
+		w = {0, 0, 0, NUM_COROS, 0};
+	for (long r = 0; r < rounds; r++) {
+		run_workers(ws, &seed, completed.data());
+		for (int i = 0; i < n; i++)
+			load_report_publish(&reports[i], completed[i], completed[i] & 63, NUM_COROS);
+		uint32_t nb = xorshift32(&seed) % (n * MAX_DISPATCH_UNIT) + 1;
+		pkts += nb;
+
+		start = rdtsc();
+		for (int i = 0; i < n; i++) {
+			worker *w = &ws[i];
+			load_report_read(&reports[i], &report);
+			w->num_running_jobs -= report.completed - w->prev_completed;
+			w->prev_completed = report.completed;
+			w->serviced_quanta = report.sq;
+			w->num_coros = report.coros;
+			keys[i] = msq_key(w);
+		}
+		uint32_t unit = (nb + n - 1) / n;
+		for (uint32_t i = 0; i < nb; i += unit) {
+			worker *w = &ws[load_argmin(keys.data(), keys.size())];
+			w->num_running_jobs += std::min(unit, nb - i);
+			sum += w - ws.data();
+			keys[w - ws.data()] = msq_key(w);
+		}
+		cycles += rdtsc() - start;
+	}
+	*checksum = sum;
+	*num_pkts = pkts;
+	return cycles;
+}
+
+/*
+ * Every worker the argmin picks must be one the heap could have popped, i.e.
+ * no worker ranks above it; workers the heap ranks equal may differ, so the
+ * "picks" checksums of the two runs may too.
+ */
+static void check_picks(int n, long rounds)
+{
+	std::vector<worker> ws(n);
+	std::vector<int32_t> keys(load_scan_size(n), LOAD_KEY_MAX);
+	std::vector<uint64_t> completed(n, 0);
+	uint32_t seed = 1;
+
+	for (auto &w : ws)
+		w = {0, 0, 0, NUM_COROS, 0};
+	for (long r = 0; r < rounds; r++) {
+		run_workers(ws, &seed, completed.data());
+		for (int i = 0; i < n; i++) {
+			worker *w = &ws[i];
+			w->num_running_jobs -= completed[i] - w->prev_completed;
+			w->prev_completed = completed[i];
+			w->serviced_quanta = completed[i] & 63;
+			keys[i] = msq_key(w);
+		}
+		uint32_t nb = xorshift32(&seed) % (n * MAX_DISPATCH_UNIT) + 1;
+		uint32_t unit = (nb + n - 1) / n;
+		for (uint32_t i = 0; i < nb; i += unit) {
+			worker *w = &ws[load_argmin(keys.data(), keys.size())];
+			for (auto &o : ws) {
+				if (worker_ptr_cmp(w, &o)) {
+					fprintf(stderr, "%d workers, round %ld: scan picked worker %ld (backlog %d, sq %d), heap ranks worker %ld (backlog %d, sq %d) above it\n",
+					        n, r, (long)(w - ws.data()), backlog(w), w->serviced_quanta,
+					        (long)(&o - ws.data()), backlog(&o), o.serviced_quanta);
+					exit(1);
+				}
+			}
+			w->num_running_jobs += std::min(unit, nb - i);
+			keys[w - ws.data()] = msq_key(w);
+		}
+	}
+}
+
+/*
+ * With --admit-max-queue, saturate the workers, let them drain, and check
+ * that the next burst is admitted. Check-ins only come after enough packets
+ * were dispatched, so as in tq_server a worker that looks full is read again
+ * before a packet is rejected for it, and all of them once a burst.
+ */
+static void check_admission(int n)
+{
+	std::vector<worker> ws(n);
+	std::vector<load_report> reports(n);
+	std::vector<uint32_t> dispatched(n, 0);
+	struct load_report report;
+	uint32_t burst = n * MAX_DISPATCH_UNIT, checkin_period = 2 * burst, since_checkin = 0;
+	uint32_t rejects = 0;
+
+	auto read_report = [&](int i) {
+		worker *w = &ws[i];
+		load_report_read(&reports[i], &report);
+		w->num_running_jobs -= report.completed - w->prev_completed;
+		w->prev_completed = report.completed;
+		w->serviced_quanta = report.sq;
+		w->num_coros = report.coros;
+	};
+	auto pick = [&]() {
+		return std::min_element(ws.begin(), ws.end(), [](const worker &a, const worker &b) {
+			return msq_key(&a) < msq_key(&b);
+		}) - ws.begin();
+	};
+	auto dispatch = [&]() {
+		bool reread = false;
+		rejects = 0;
+		for (uint32_t p = 0; p < burst; p++) {
+			int i = pick();
+			if (ws[i].num_running_jobs >= ADMIT_MAX_QUEUE) {
+				read_report(i);
+				if (ws[i].num_running_jobs >= ADMIT_MAX_QUEUE && !reread) {
+					reread = true;
+					for (int j = 0; j < n; j++)
+						read_report(j);
+					i = pick();
+				}
+				if (ws[i].num_running_jobs >= ADMIT_MAX_QUEUE) {
+					rejects++;
+					continue;
+				}
+			}
+			ws[i].num_running_jobs++;
+			dispatched[i]++;
+			since_checkin++;
+		}
+		if (since_checkin >= checkin_period) {
+			for (int i = 0; i < n; i++)
+				read_report(i);
+			since_checkin = 0;
+		}
+	};
+
+	for (auto &w : ws)
+		w = {0, 0, 0, NUM_COROS, 0};
+	for (int i = 0; i < n; i++)
+		load_report_publish(&reports[i], 0, 0, NUM_COROS);
+	// the workers complete nothing until all of them are full
+	for (int r = 0; r <= ADMIT_MAX_QUEUE / MAX_DISPATCH_UNIT; r++)
+		dispatch();
+	if (rejects == 0) {
+		fprintf(stderr, "%d workers: nothing rejected with every worker at the limit\n", n);
+		exit(1);
+	}
+	// then complete everything they were given
+	for (int i = 0; i < n; i++)
+		load_report_publish(&reports[i], dispatched[i], 0, NUM_COROS);
+	dispatch();
+	if (rejects) {
+		fprintf(stderr, "%d workers: %u of %u packets still rejected after the workers drained\n", n, rejects, burst);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long rounds = (argc > 1)? atol(argv[1]) : DEFAULT_ROUNDS;
+	static const int num_workers[] = {16, 32, 64};
+	uint64_t heap_cycles, scan_cycles, heap_sum, scan_sum, heap_pkts, scan_pkts;
+
+	printf("workers  heap cycles/round (/packet)  scan cycles/round (/packet)\n");
+	for (int n : num_workers) {
+		check_picks(n, rounds);
+		check_admission(n);
+		heap_cycles = run_heap(n, rounds, &heap_sum, &heap_pkts);
+		scan_cycles = run_scan(n, rounds, &scan_sum, &scan_pkts);
+		printf("%7d  %17.2f (%6.2f)  %17.2f (%6.2f)  (picks %lu vs %lu)\n", n,
+		       (double)heap_cycles / rounds, (double)heap_cycles / heap_pkts,
+		       (double)scan_cycles / rounds, (double)scan_cycles / scan_pkts, heap_sum, scan_sum);
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Cycles per LAS scheduling decision (pick, quanta to assign, requeue or
+ * replace a finished job), std::priority_queue vs. the bucketed las_queue,
+ * at several coroutines per worker.
+ *
+ * usage: ./profile_las [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <queue>
+#include <vector>
+#include "las_queue.h"
+
+#define DEFAULT_ITERATIONS 10000000
+// same cap as DISPATCH_RING_DEQUEUE_PERIOD in tq_server
+#define MAX_ASSIGNED_QUANTA 4
+// 1 in FINISH_ONE_IN jobs finishes after a quantum and is replaced by a new one
+#define FINISH_ONE_IN 8
+
+struct job {
+	uint32_t num_quanta;
+	struct job *las_next;
+};
+
+static bool job_ptr_cmp(const job *lhs, const job *rhs) {
+	return lhs->num_quanta > rhs->num_quanta; // so that it's a min heap
+}
+
+static uint64_t rdtsc(){
+    unsigned int lo,hi;
+    __asm__ __volatile__ ("lfence\n\t" "rdtsc": "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint32_t xorshift32(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static inline uint32_t assign(const job *next, const job *runner_up) {
+	uint32_t n = (runner_up == nullptr || runner_up->num_quanta <= next->num_quanta)? 1 : runner_up->num_quanta - next->num_quanta + 1;
+	return (n <= MAX_ASSIGNED_QUANTA)? n : MAX_ASSIGNED_QUANTA;
+}
+
+/* same job mix for both, the checksum keeps the work from being optimized out */
+static uint64_t run_heap(std::vector<job> &jobs, long iterations, uint64_t *checksum)
+{
+	std::priority_queue<job*, std::vector<job*>, decltype(&job_ptr_cmp)> q(job_ptr_cmp);
+	uint32_t seed = 1;
+	uint64_t start, sum = 0;
+
+	for (auto &j : jobs)
+		q.push(&j);
+	start = rdtsc();
+	for (long n = 0; n < iterations; n++) {
+		job *next = q.top();
+		q.pop();
+		uint32_t assigned = assign(next, q.empty()? nullptr : q.top());
+		sum += assigned;
+		next->num_quanta = (xorshift32(&seed) % FINISH_ONE_IN == 0)? 0 : next->num_quanta + assigned;
+		q.push(next);
+	}
+	*checksum = sum;
+	return rdtsc() - start;
+}
+
+static uint64_t run_buckets(std::vector<job> &jobs, long iterations, uint64_t *checksum)
+{
+	las_queue<job> q;
+	uint32_t seed = 1;
+	uint64_t start, sum = 0;
+
+	for (auto &j : jobs)
+		q.push(&j);
+	start = rdtsc();
+	for (long n = 0; n < iterations; n++) {
+		job *next = q.pop();
+		uint32_t assigned = assign(next, q.min());
+		sum += assigned;
+		next->num_quanta = (xorshift32(&seed) % FINISH_ONE_IN == 0)? 0 : next->num_quanta + assigned;
+		q.push(next);
+	}
+	*checksum = sum;
+	return rdtsc() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = (argc > 1)? atol(argv[1]) : DEFAULT_ITERATIONS;
+	static const int num_coros[] = {8, 32, 128};
+	uint64_t heap_cycles, bucket_cycles, heap_sum, bucket_sum;
+
+	printf("coros  heap cycles/pick  buckets cycles/pick\n");
+	for (int n : num_coros) {
+		std::vector<job> heap_jobs(n), bucket_jobs(n);
+		for (int i = 0; i < n; i++)
+			heap_jobs[i].num_quanta = bucket_jobs[i].num_quanta = i % 16;
+		heap_cycles = run_heap(heap_jobs, iterations, &heap_sum);
+		bucket_cycles = run_buckets(bucket_jobs, iterations, &bucket_sum);
+		printf("%5d  %16.2f  %19.2f  (quanta assigned %lu vs %lu)\n", n, (double)heap_cycles / iterations,
+		       (double)bucket_cycles / iterations, heap_sum, bucket_sum);
+	}
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Per-response cost of building the Ethernet/IPv4/UDP/RocksDB headers,
+ * field by field vs. blitting the per-worker template.
+ *
+ * usage: ./profile_response_hdr [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "response_hdr.h"
+
+#define NUM_BUFS 256
+#define BUF_SIZE 128
+#define DEFAULT_ITERATIONS 10000000
+
+static uint64_t rdtsc(){
+    unsigned int lo,hi;
+    __asm__ __volatile__ ("lfence\n\t" "rdtsc": "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+alignas(64) static char reqs[NUM_BUFS][BUF_SIZE];
+alignas(64) static char resps[NUM_BUFS][BUF_SIZE];
+
+static void fill_requests(const struct rte_ether_addr *my_eth, uint32_t my_ip)
+{
+	for (int i = 0; i < NUM_BUFS; i++) {
+		struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *) reqs[i];
+		struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *) (reqs[i] + IPV4_HDR_OFFSET);
+		struct rte_udp_hdr *udp_hdr = (struct rte_udp_hdr *) (reqs[i] + UDP_HDR_OFFSET);
+		struct rte_rocksdb_hdr *rocksdb_hdr = (struct rte_rocksdb_hdr *) (reqs[i] + ROCKSDB_HDR_OFFSET);
+
+		for (int b = 0; b < RTE_ETHER_ADDR_LEN; b++)
+			eth_hdr->src_addr.addr_bytes[b] = rand();
+		rte_ether_addr_copy(my_eth, &eth_hdr->dst_addr);
+		eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+		ipv4_hdr->version_ihl = 0x45;
+		ipv4_hdr->packet_id = rand();
+		ipv4_hdr->fragment_offset = 0;
+		ipv4_hdr->time_to_live = 64;
+		ipv4_hdr->next_proto_id = IPPROTO_UDP;
+		ipv4_hdr->hdr_checksum = rand();
+		ipv4_hdr->src_addr = rand();
+		ipv4_hdr->dst_addr = rte_cpu_to_be_32(my_ip);
+		udp_hdr->src_port = rand();
+		udp_hdr->dst_port = rte_cpu_to_be_16(8001);
+		rocksdb_hdr->id = rand();
+		rocksdb_hdr->req_type = rte_cpu_to_be_32(0xA);
+		rocksdb_hdr->req_size = rand();
+		rocksdb_hdr->run_ns = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = (argc > 1)? atol(argv[1]) : DEFAULT_ITERATIONS;
+	struct rte_ether_addr my_eth = {{0x0c, 0x42, 0xa1, 0x01, 0x02, 0x03}};
+	uint32_t my_ip = 0xc0a80103; // 192.168.1.3
+	uint16_t port = 8001;
+	response_template_t tmpl;
+	uint64_t start, fields_cycles, template_cycles;
+	struct rte_rocksdb_hdr *rocksdb_hdr;
+
+	fill_requests(&my_eth, my_ip);
+	init_response_template(&tmpl, &my_eth, my_ip, port);
+
+	// both must build the same headers
+	for (int i = 0; i < NUM_BUFS; i++) {
+		char expected[BUF_SIZE];
+		fill_response_hdr_fields(expected, reqs[i], &my_eth, my_ip, port);
+		fill_response_hdr_template(resps[i], reqs[i], &tmpl);
+		if (memcmp(expected, resps[i], ROCKSDB_HDR_OFFSET + offsetof(struct rte_rocksdb_hdr, run_ns)) != 0) {
+			printf("template and field-by-field headers differ for request %d\n", i);
+			return 1;
+		}
+	}
+
+	start = rdtsc();
+	for (long n = 0; n < iterations; n++) {
+		int i = n & (NUM_BUFS - 1);
+		fill_response_hdr_fields(resps[i], reqs[i], &my_eth, my_ip, port);
+		rocksdb_hdr = (struct rte_rocksdb_hdr *) (resps[i] + ROCKSDB_HDR_OFFSET);
+		rocksdb_hdr->run_ns = 0;
+		__asm__ __volatile__ ("" ::: "memory");
+	}
+	fields_cycles = rdtsc() - start;
+
+	start = rdtsc();
+	for (long n = 0; n < iterations; n++) {
+		int i = n & (NUM_BUFS - 1);
+		fill_response_hdr_template(resps[i], reqs[i], &tmpl);
+		rocksdb_hdr = (struct rte_rocksdb_hdr *) (resps[i] + ROCKSDB_HDR_OFFSET);
+		rocksdb_hdr->run_ns = 0;
+		__asm__ __volatile__ ("" ::: "memory");
+	}
+	template_cycles = rdtsc() - start;
+
+	printf("Field by field: %.2f cycles per response\n", (double)fields_cycles / iterations);
+	printf("Template blit: %.2f cycles per response\n", (double)template_cycles / iterations);
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Cycles per resume-yield pair of a worker coroutine, boost::coroutines2 vs.
+ * the hand-written switch of coro_switch.h. The coroutine yields right away,
+ * as a preempted job does from the CI handler.
+ *
+ * usage: ./profile_switch [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <boost/coroutine2/all.hpp>
+#include "coro_switch.h"
+
+#define STACK_SIZE (128 * 1024)
+#define DEFAULT_ITERATIONS 10000000
+
+typedef boost::coroutines2::coroutine<void*> coro_t;
+
+static uint64_t rdtsc(){
+    unsigned int lo,hi;
+    __asm__ __volatile__ ("lfence\n\t" "rdtsc": "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+alignas(64) static char stack[STACK_SIZE];
+static void *worker_sp, *coro_sp;
+static long num_resumes;
+
+static void coro(void *)
+{
+	for (;;) {
+		num_resumes++;
+		coro_switch(&coro_sp, worker_sp);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = (argc > 1)? atol(argv[1]) : DEFAULT_ITERATIONS;
+	uint64_t start, boost_cycles, switch_cycles;
+	long boost_resumes = 0;
+
+	// the worker loop resumes with operator() and checks get(), the job yields nullptr
+	coro_t::pull_type boost_coro(boost::coroutines2::fixedsize_stack(STACK_SIZE), [&](coro_t::push_type &yield) {
+		for (;;) {
+			boost_resumes++;
+			yield(nullptr);
+		}
+	});
+	boost_resumes = 0;
+	start = rdtsc();
+	for (long n = 0; n < iterations; n++) {
+		boost_coro();
+		if (boost_coro.get() != nullptr)
+			abort();
+	}
+	boost_cycles = rdtsc() - start;
+
+	coro_sp = coro_init(stack + STACK_SIZE, coro, nullptr);
+	start = rdtsc();
+	for (long n = 0; n < iterations; n++)
+		coro_switch(&worker_sp, coro_sp);
+	switch_cycles = rdtsc() - start;
+
+	if (boost_resumes != iterations || num_resumes != iterations) {
+		printf("lost resumes: boost %ld, coro_switch %ld of %ld\n", boost_resumes, num_resumes, iterations);
+		return 1;
+	}
+	printf("boost::coroutines2: %.2f cycles per resume-yield pair\n", (double)boost_cycles / iterations);
+	printf("coro_switch: %.2f cycles per resume-yield pair\n", (double)switch_cycles / iterations);
+	return 0;
+}
@@ -0,0 +1,139 @@
+#ifndef RESPONSE_HDR_H
+#define RESPONSE_HDR_H
+
+/*
+ * Building the Ethernet/IPv4/UDP/RocksDB headers of a response, shared by
+ * tq_server and profile_response_hdr.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+#include <rte_memcpy.h>
+
+struct rte_rocksdb_hdr {
+        uint32_t id;
+        uint32_t req_type;
+        uint32_t req_size;
+        uint32_t run_ns;
+};
+
+/*
+ * A request may extend the RocksDB header with its latency SLO, used as its
+ * deadline by the edf scheduler; responses never carry it
+ */
+struct rte_rocksdb_ext_hdr {
+	struct rte_rocksdb_hdr hdr;
+	// 0 for the default of its req_type
+	uint32_t slo_us;
+};
+
+/* set in the req_type of a response to a request that was not admitted */
+#define RESP_STATUS_OVERLOADED (1u << 31)
+
+#define IPV4_HDR_OFFSET RTE_ETHER_HDR_LEN
+#define UDP_HDR_OFFSET (IPV4_HDR_OFFSET + sizeof(struct rte_ipv4_hdr))
+#define ROCKSDB_HDR_OFFSET (UDP_HDR_OFFSET + sizeof(struct rte_udp_hdr))
+#define RESPONSE_HDR_LEN (ROCKSDB_HDR_OFFSET + sizeof(struct rte_rocksdb_hdr))
+#define REQUEST_EXT_HDR_LEN (ROCKSDB_HDR_OFFSET + sizeof(struct rte_rocksdb_ext_hdr))
+// the blit always writes this much, the mbuf data room easily covers it
+#define RESPONSE_TEMPLATE_SIZE 64
+
+static_assert(RESPONSE_HDR_LEN <= RESPONSE_TEMPLATE_SIZE, "response header does not fit the template");
+
+typedef struct response_template {
+	alignas(RESPONSE_TEMPLATE_SIZE) uint8_t bytes[RESPONSE_TEMPLATE_SIZE];
+} response_template_t;
+
+/*
+ * Build the headers of the response to req field by field into buf
+ */
+static inline void fill_response_hdr_fields(char *buf, const char *req, const struct rte_ether_addr *my_eth, uint32_t my_ip, uint16_t port)
+{
+	const struct rte_ether_hdr *rx_ptr_mac_hdr = (const struct rte_ether_hdr *) req;
+	const struct rte_ipv4_hdr *rx_ptr_ipv4_hdr = (const struct rte_ipv4_hdr *) (req + IPV4_HDR_OFFSET);
+	const struct rte_udp_hdr *rx_ptr_udp_hdr = (const struct rte_udp_hdr *) (req + UDP_HDR_OFFSET);
+	const struct rte_rocksdb_hdr *rx_ptr_rocksdb_hdr = (const struct rte_rocksdb_hdr *) (req + ROCKSDB_HDR_OFFSET);
+	struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *) buf;
+	struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *) (buf + IPV4_HDR_OFFSET);
+	struct rte_udp_hdr *rte_udp_hdr = (struct rte_udp_hdr *) (buf + UDP_HDR_OFFSET);
+	struct rte_rocksdb_hdr *rte_rocksdb_hdr = (struct rte_rocksdb_hdr *) (buf + ROCKSDB_HDR_OFFSET);
+
+	/* ethernet header */
+	rte_ether_addr_copy(my_eth, &eth_hdr->src_addr);
+	rte_ether_addr_copy(&rx_ptr_mac_hdr->src_addr, &eth_hdr->dst_addr);
+	eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+
+	/* IPv4 header */
+	ipv4_hdr->version_ihl = 0x45;
+	ipv4_hdr->type_of_service = 0;
+	ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
+	ipv4_hdr->packet_id = rx_ptr_ipv4_hdr->packet_id;
+	ipv4_hdr->fragment_offset = rx_ptr_ipv4_hdr->fragment_offset;
+	ipv4_hdr->time_to_live = 64;
+	ipv4_hdr->next_proto_id = IPPROTO_UDP;
+	ipv4_hdr->hdr_checksum = rx_ptr_ipv4_hdr->hdr_checksum;
+	ipv4_hdr->src_addr = rte_cpu_to_be_32(my_ip);
+	ipv4_hdr->dst_addr = rx_ptr_ipv4_hdr->src_addr;
+
+	/* UDP header */
+	rte_udp_hdr->src_port = rte_cpu_to_be_16(port);
+	rte_udp_hdr->dst_port = rx_ptr_udp_hdr->src_port;
+	rte_udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
+	rte_udp_hdr->dgram_cksum = 0;
+
+	/* RocksDB header, run_ns is up to the caller */
+	rte_rocksdb_hdr->id = rx_ptr_rocksdb_hdr->id;
+	rte_rocksdb_hdr->req_type = rx_ptr_rocksdb_hdr->req_type;
+	rte_rocksdb_hdr->req_size = rx_ptr_rocksdb_hdr->req_size;
+}
+
+/*
+ * Pre-fill the fields that are the same for every response
+ */
+static inline void init_response_template(response_template_t *tmpl, const struct rte_ether_addr *my_eth, uint32_t my_ip, uint16_t port)
+{
+	struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *) tmpl->bytes;
+	struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *) (tmpl->bytes + IPV4_HDR_OFFSET);
+	struct rte_udp_hdr *rte_udp_hdr = (struct rte_udp_hdr *) (tmpl->bytes + UDP_HDR_OFFSET);
+
+	memset(tmpl, 0, sizeof(*tmpl));
+	rte_ether_addr_copy(my_eth, &eth_hdr->src_addr);
+	eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+	ipv4_hdr->version_ihl = 0x45;
+	ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
+	ipv4_hdr->time_to_live = 64;
+	ipv4_hdr->next_proto_id = IPPROTO_UDP;
+	ipv4_hdr->src_addr = rte_cpu_to_be_32(my_ip);
+	rte_udp_hdr->src_port = rte_cpu_to_be_16(port);
+	rte_udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
+}
+
+/*
+ * Same result as fill_response_hdr_fields(): blit the template with wide
+ * stores, then patch the per-flow fields. Writes RESPONSE_TEMPLATE_SIZE bytes.
+ */
+static inline void fill_response_hdr_template(char *buf, const char *req, const response_template_t *tmpl)
+{
+	const struct rte_ether_hdr *rx_ptr_mac_hdr = (const struct rte_ether_hdr *) req;
+	const struct rte_ipv4_hdr *rx_ptr_ipv4_hdr = (const struct rte_ipv4_hdr *) (req + IPV4_HDR_OFFSET);
+	const struct rte_udp_hdr *rx_ptr_udp_hdr = (const struct rte_udp_hdr *) (req + UDP_HDR_OFFSET);
+	struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *) buf;
+	struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *) (buf + IPV4_HDR_OFFSET);
+	struct rte_udp_hdr *rte_udp_hdr = (struct rte_udp_hdr *) (buf + UDP_HDR_OFFSET);
+
+	rte_mov64((uint8_t *) buf, tmpl->bytes);
+
+	rte_ether_addr_copy(&rx_ptr_mac_hdr->src_addr, &eth_hdr->dst_addr);
+	// packet_id and fragment_offset are adjacent
+	memcpy(&ipv4_hdr->packet_id, &rx_ptr_ipv4_hdr->packet_id, sizeof(uint32_t));
+	ipv4_hdr->hdr_checksum = rx_ptr_ipv4_hdr->hdr_checksum;
+	ipv4_hdr->dst_addr = rx_ptr_ipv4_hdr->src_addr;
+	rte_udp_hdr->dst_port = rx_ptr_udp_hdr->src_port;
+	// id, req_type and req_size, run_ns is up to the caller
+	rte_mov16((uint8_t *) buf + ROCKSDB_HDR_OFFSET, (const uint8_t *) req + ROCKSDB_HDR_OFFSET);
+}
+
+#endif /* RESPONSE_HDR_H */
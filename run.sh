@@ -39,5 +39,5 @@ echo "Setting cores to performance mode"
 
 echo ""
 echo "Running TQ server"
-./run_server.sh
+./run_server.sh --quantum-cycle $quantum_cycle --coros $num_worker_coros
 
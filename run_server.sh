@@ -1,5 +1,6 @@
 #!/bin/bash
 
-sudo ./tq_server -l 28-55 --socket-mem=0,1024 -- 192.168.1.3
+# server options go before the IP, e.g. ./run_server.sh --sched las --dispatch jsq
+sudo ./tq_server -l 28-55 --socket-mem=0,1024 -- "$@" 192.168.1.3
 #12.12.12.12
 #sudo rm -rf /tmpfs/experiments/my_db/
@@ -0,0 +1,179 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/*
+ * Counters of the workers and dispatchers, exported through a POSIX
+ * shared-memory segment and read by tq_telemetry. Every counter has a single
+ * writer and lives on cache lines of its own, so updating one is a plain
+ * store and readers never slow the writers down.
+ */
+
+#include <stdint.h>
+
+#define TELEMETRY_SHM_NAME "/tq_telemetry"
+#define TELEMETRY_MAGIC 0x54515431 // "TQT1"
+#define TELEMETRY_CACHE_LINE 64
+// per job type counters are indexed by req_type, the last slot takes the rest
+#define TELEMETRY_NUM_JOB_TYPES 32
+// run, fetch (dispatch ring or NIC), TX and RX mbuf return of the worker loop
+#define TELEMETRY_NUM_STAGES 4
+// time the stages of one in this many loop iterations
+#define TELEMETRY_STAGE_SAMPLE_PERIOD 64
+
+/*
+ * Log-linear histograms: 2^HIST_SUB_BITS buckets per power of two, so a
+ * bucket is within 1/2^HIST_SUB_BITS of its values; exact below 2^HIST_SUB_BITS
+ * and capped at 2^HIST_MAX_BITS
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 48
+#define HIST_NUM_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+enum latency_metric {
+	// arrival to first run, in cycles
+	LAT_QUEUEING = 0,
+	// cycles spent running
+	LAT_SERVICE,
+	LAT_QUANTA,
+	// arrival to completion, in cycles
+	LAT_SOJOURN,
+	LAT_NUM_METRICS
+};
+
+struct latency_hist {
+	alignas(TELEMETRY_CACHE_LINE) uint64_t counts[HIST_NUM_BUCKETS];
+};
+
+enum telemetry_stage {
+	STAGE_RUN = 0,
+	STAGE_FETCH,
+	STAGE_TX,
+	STAGE_RETURN
+};
+
+struct telemetry_hdr {
+	alignas(TELEMETRY_CACHE_LINE) uint32_t magic;
+	uint32_t num_workers;
+	uint32_t num_dispatchers;
+	uint32_t num_job_types;
+	uint64_t tsc_hz;
+};
+
+struct worker_telemetry {
+	alignas(TELEMETRY_CACHE_LINE) uint64_t rx_pkts;
+	uint64_t tx_pkts;
+	// invalid requests and responses the NIC did not take
+	uint64_t drops;
+	uint64_t rejects;
+	// gauges, sampled whenever the worker fetches new requests
+	uint64_t ring_occupancy;
+	uint64_t busy_coros;
+	// coroutines in the pool, busy or idle
+	uint64_t coros;
+	// deepest coroutine stack seen so far, in bytes
+	uint64_t stack_used;
+	// current quantum, which the adaptive controller may change
+	uint64_t quantum_cycles;
+	uint64_t stage_samples;
+	alignas(TELEMETRY_CACHE_LINE) uint64_t stage_cycles[TELEMETRY_NUM_STAGES];
+	alignas(TELEMETRY_CACHE_LINE) uint64_t preemptions[TELEMETRY_NUM_JOB_TYPES];
+	alignas(TELEMETRY_CACHE_LINE) uint64_t completions[TELEMETRY_NUM_JOB_TYPES];
+	// quanta of the completed jobs
+	alignas(TELEMETRY_CACHE_LINE) uint64_t quanta[TELEMETRY_NUM_JOB_TYPES];
+	struct latency_hist hists[TELEMETRY_NUM_JOB_TYPES][LAT_NUM_METRICS];
+};
+
+struct dispatcher_telemetry {
+	alignas(TELEMETRY_CACHE_LINE) uint64_t rx_pkts;
+	uint64_t dispatched;
+	// dispatch rings were full
+	uint64_t drops;
+	uint64_t rejects;
+	// handed off to a peer dispatcher
+	uint64_t handoffs;
+};
+
+/* the segment is the header, then the workers, then the dispatchers */
+static inline uint64_t telemetry_size(uint32_t num_workers, uint32_t num_dispatchers)
+{
+	return sizeof(struct telemetry_hdr) + num_workers * sizeof(struct worker_telemetry) +
+	       num_dispatchers * sizeof(struct dispatcher_telemetry);
+}
+
+static inline struct worker_telemetry *telemetry_workers(const struct telemetry_hdr *hdr)
+{
+	return (struct worker_telemetry *) ((char *) hdr + sizeof(struct telemetry_hdr));
+}
+
+static inline struct dispatcher_telemetry *telemetry_dispatchers(const struct telemetry_hdr *hdr)
+{
+	return (struct dispatcher_telemetry *) (telemetry_workers(hdr) + hdr->num_workers);
+}
+
+static inline uint32_t telemetry_job_slot(uint32_t req_type)
+{
+	return req_type < TELEMETRY_NUM_JOB_TYPES? req_type : TELEMETRY_NUM_JOB_TYPES - 1;
+}
+
+/* only the owner writes a counter, one untorn store is all a reader needs */
+static inline void telemetry_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void telemetry_set(uint64_t *gauge, uint64_t v)
+{
+	__atomic_store_n(gauge, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t telemetry_read(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t hist_bucket(uint64_t v)
+{
+	uint32_t msb;
+
+	if (v < HIST_SUB_BUCKETS)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= HIST_MAX_BITS)
+		return HIST_NUM_BUCKETS - 1;
+	// the HIST_SUB_BITS bits below the leading one pick the sub-bucket
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* largest value that falls into bucket b */
+static inline uint64_t hist_bucket_max(uint32_t b)
+{
+	uint32_t e = b / HIST_SUB_BUCKETS, sub = b % HIST_SUB_BUCKETS;
+
+	if (e == 0)
+		return sub;
+	return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (e - 1)) - 1;
+}
+
+static inline void hist_record(struct latency_hist *h, uint64_t v)
+{
+	telemetry_add(&h->counts[hist_bucket(v)], 1);
+}
+
+/* value at quantile q of counts that hold total samples, 0 if empty */
+static inline uint64_t hist_quantile(const uint64_t *counts, uint64_t total, double q)
+{
+	uint64_t rank = (uint64_t)(q * total), seen = 0;
+
+	// the smallest value with at least q of the samples at or below it
+	if (rank < q * total || rank == 0)
+		rank++;
+	for (uint32_t b = 0; b < HIST_NUM_BUCKETS; b++) {
+		seen += counts[b];
+		if (seen >= rank)
+			return hist_bucket_max(b);
+	}
+	return 0;
+}
+
+#endif /* TELEMETRY_H */
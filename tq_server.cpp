@@ -10,33 +10,54 @@
 #include <rte_mbuf.h>
 #include <rte_udp.h>
 #include <rte_ring.h>
+#include <rte_flow.h>
 #include <rte_mbuf_pool_ops.h>
 #include <rte_malloc.h>
 #include <vector>
 #include <iostream>
 #include <queue>
-#include <boost/coroutine2/all.hpp>
-#include <boost/bind.hpp>
-#include <boost/context/stack_context.hpp>
 #include "rocksdb/c.h"
 #include "ci_lib.h"
 #include <string>
 #include <sys/mman.h> // mmap, munmap
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <climits>
+#include <cerrno>
+#include <cctype>
+#include <strings.h>
+#include <algorithm>
+#include <emmintrin.h>
 #include "fake_work_cp.h"
-
-#ifdef RECORD_NUM_PRE
+#include "response_hdr.h"
+#include "telemetry.h"
+#include "las_queue.h"
+#include "coro_switch.h"
+#include "load_report.h"
 #include <csignal>
-#endif
 
+// defaults of the runtime parameters, see parse_args()
 #define NUM_WORKER_THREADS 16
+#ifndef NUM_DISPATCHERS
+#define NUM_DISPATCHERS 1
+#endif
 #ifndef NUM_WORKER_COROS
 #define NUM_WORKER_COROS 8/*4*/
 #endif
 #define MAX_DISPATCH_UNIT 4
+// workers sampled per pick by jsq-d
+#define DISPATCH_D 2
 
 // shared among cores
 #define RX_RING_SIZE 4096/*1024*/
-#define RX_QUEUE_BURST_SIZE (NUM_WORKER_THREADS * MAX_DISPATCH_UNIT)
+// at most 1/(2^REBALANCE_SHIFT) of a burst is handed off to another dispatcher
+#define HANDOFF_RING_SIZE 4096
+#define REBALANCE_SHIFT 1
+#define REBALANCE_THRESHOLD 2
+// dispatcher-free mode: each worker bursts from its own RX queue
+#define WS_RX_BURST_SIZE 32
+#define WS_STEAL_ATTEMPTS 2
 #define RX_MBUF_POOL_SIZE 131071/*32767*/
 #define RX_MBUF_CACHE_SIZE 500
 #define TX_MBUF_POOL_SIZE 8191
@@ -52,27 +73,57 @@
 #ifdef NEW_DISPATCHER
 #define RETURN_RING_BURST_SIZE 64
 #define RETURN_RING_CHECKIN_PERIOD_PER_THREAD 8/*2*/
-#define RETURN_RING_CHECKIN_PERIOD 1//(NUM_WORKER_THREADS * RETURN_RING_CHECKIN_PERIOD_PER_THREAD)
+#define RETURN_RING_CHECKIN_PERIOD 1//(num_worker_threads * RETURN_RING_CHECKIN_PERIOD_PER_THREAD)
 #else
 #define RETURN_RING_SIZE 512
 #define RETURN_RING_BURST_SIZE 8
-#define RETURN_RING_CHECKIN_PERIOD (RETURN_RING_BURST_SIZE * NUM_WORKER_THREADS * 2)
-#define FREE_MBUF_MAX_BATCH_SIZE (RETURN_RING_SIZE * NUM_WORKER_THREADS)
+#define RETURN_RING_CHECKIN_PERIOD (RETURN_RING_BURST_SIZE * num_worker_threads * 2)
+#define FREE_MBUF_MAX_BATCH_SIZE (RETURN_RING_SIZE * num_worker_threads)
 #endif
 
-#define MAX_NUM_RX_MBUF_PER_THREAD (DISPATCH_RING_SIZE + NUM_WORKER_COROS + RETURN_RING_BURST_SIZE)
-#define MAX_NUM_TX_MBUF_PER_THREAD (NUM_WORKER_COROS + TX_QUEUE_BURST_SIZE)
+#define MAX_NUM_RX_MBUF_PER_THREAD (dispatch_ring_size + max_worker_coros + RETURN_RING_BURST_SIZE)
+#define MAX_NUM_TX_MBUF_PER_THREAD (max_worker_coros + TX_QUEUE_BURST_SIZE)
 
 #define STACK_SIZE (128 * 1024)
-#define HUGE_PAGE_SIZE (1 << 30)
-
-#define PREFETCH_OFFSET 1
+// debug builds put a PROT_NONE page below every coroutine stack
+#ifdef NDEBUG
+#define STACK_GUARD_SIZE 0
+#else
+#define STACK_GUARD_SIZE 4096
+#endif
+// unused stack words keep this value, see stack_arena
+#define STACK_PAINT 0x6b6174536b617453ULL // "StakStak"
+// completions between two scans of a coroutine stack for its depth
+#define STACK_SCAN_PERIOD 65536
+// a worker republishes its serviced quanta only after they grew by this many
+#define LOAD_REPORT_SQ_STEP 8
+
+#define PREFETCH_OFFSET 4
 #ifndef QUANTUM_CYCLE
 #define QUANTUM_CYCLE 1000
 #endif
 #ifndef QUANTUM_IC
 #define QUANTUM_IC 9000
 #endif
+// bounds of the adaptive quantum, in cycles
+#define QUANTUM_MIN_CYCLE 1000
+#define QUANTUM_MAX_CYCLE 100000
+// the adaptive quantum is retuned every this many completions
+#define QUANTUM_EPOCH_JOBS 256
+// estimated cycles lost per preemption (handler, two context switches, cache refill)
+#define PREEMPTION_COST_CYCLES 300
+// grow the quantum once preemptions take more than this share of the cycles
+#define PREEMPTION_OVERHEAD_PCT 5
+
+#define CODEL_INTERVAL_US 100
+// extra coroutines idle for this long are retired
+#define CORO_COOLDOWN_US 1000
+
+// request classes of the mlfq scheduler are indexed by req_type, the last takes the rest
+#define NUM_JOB_CLASSES 64
+#define MLFQ_LEVELS 16
+// latency SLO of the requests that do not carry one, for the edf scheduler
+#define SLO_US 1000
 
 #define LARGE_QUANTUM 10000000
 
@@ -91,9 +142,6 @@ typedef struct worker_arg {
     #ifndef NEW_DISPATCHER
     struct rte_ring* rx_mbuf_return_q;
     #endif
-    #ifdef STACKS_FROM_HUGEPAGE
-    char* stack_pool;
-    #endif
     int wid;
 } worker_arg_t;
 
@@ -107,36 +155,43 @@ typedef struct worker_info
     int wid;
     int version_number;
     int num_running_jobs;
-    #ifdef MSQ
     int serviced_quanta;
-    #endif
+    // coroutines the worker runs jobs on, as of the last check-in
+    int num_coros;
 
     #ifdef NEW_DISPATCHER
-    #ifdef MSQ
-    worker_info(int wid) : rx_mbuf_dispatch_q(nullptr),  work_thread(nullptr), wid(wid), version_number(0), num_running_jobs(0), serviced_quanta(0) {}
-    #else
-    worker_info(int wid) : rx_mbuf_dispatch_q(nullptr),  work_thread(nullptr), wid(wid), version_number(0), num_running_jobs(0) {}
-    #endif
+    worker_info(int wid) : rx_mbuf_dispatch_q(nullptr),  work_thread(nullptr), wid(wid), version_number(0), num_running_jobs(0), serviced_quanta(0), num_coros(0) {}
     #else
-    worker_info(int wid) : rx_mbuf_dispatch_q(nullptr),  rx_mbuf_return_q(nullptr), work_thread(nullptr), wid(wid), version_number(0), num_running_jobs(0) {}
+    worker_info(int wid) : rx_mbuf_dispatch_q(nullptr),  rx_mbuf_return_q(nullptr), work_thread(nullptr), wid(wid), version_number(0), num_running_jobs(0), serviced_quanta(0), num_coros(0) {}
     #endif
-
-    friend bool operator< (worker_info const& lhs, worker_info const& rhs) {
-    	if(lhs.version_number != rhs.version_number)
-    		return lhs.version_number > rhs.version_number;
-	#ifdef MSQ
-	if(lhs.num_running_jobs == rhs.num_running_jobs)
-		return lhs.serviced_quanta < rhs.serviced_quanta;
-	#endif
-	    return lhs.num_running_jobs > rhs.num_running_jobs; // so that it's a min heap
-    }
 } worker_info_t;
 
-bool worker_info_ptr_cmp(const worker_info_t* ptr1, const worker_info_t* ptr2) {
-	return *ptr1 < *ptr2;
+/* jobs beyond the coroutines of a worker, negative while some are idle */
+static inline int worker_backlog(const worker_info_t* w) {
+	return w->num_running_jobs - w->num_coros;
+}
+
+/* Msq breaks ties in the backlog by the serviced quanta */
+template <bool Msq>
+bool worker_info_ptr_cmp(const worker_info_t* lhs, const worker_info_t* rhs) {
+	if(lhs->version_number != rhs->version_number)
+		return lhs->version_number > rhs->version_number;
+	if(Msq && worker_backlog(lhs) == worker_backlog(rhs))
+		return lhs->serviced_quanta < rhs->serviced_quanta;
+	return worker_backlog(lhs) > worker_backlog(rhs); // so that it's a min heap
 }
 
-typedef boost::coroutines2::coroutine<void*>   coro_t;
+// each dispatcher polls its own RX queue and owns a disjoint range of workers
+typedef struct dispatcher_arg {
+	int did;
+	uint16_t rx_queue;
+	int first_wid;
+	int num_workers;
+	// the last num_long_workers of them only run long requests
+	int num_long_workers;
+	worker_info_t* workers;
+} dispatcher_arg_t;
+
 // job type
 typedef enum job_type {
     ROCKSDB_GET = 0xA,
@@ -164,83 +219,110 @@ typedef struct job_info {
 
 typedef struct coro_info 
 {
-	coro_t::pull_type *coro;
-	coro_t::push_type *yield;
+	// stack pointer of the coroutine while it is switched out
+	void *sp;
+	// set by the coroutine when its job is done
+	bool finished;
 	job_info_t *jinfo;
 	struct rte_mbuf *rx_mbuf;
 	struct rte_mbuf *tx_mbuf;
 	uint32_t num_quanta;
 	uint64_t execution_time;
-	coro_info(): coro(nullptr), yield(nullptr), jinfo(nullptr), rx_mbuf(nullptr), tx_mbuf(nullptr), num_quanta(0), execution_time(0) {}
-	#ifdef LAS
+	// TSC at arrival and at the first run, for the latency histograms
+	uint64_t arrival_tsc;
+	uint64_t first_run_tsc;
+	// TSC by which the response is due, for the edf scheduler
+	uint64_t deadline;
+	// next job in the same las_queue bucket
+	struct coro_info *las_next;
+	// TSC at which the coroutine went idle, to retire the extra ones
+	uint64_t idle_since;
+	coro_info(): sp(nullptr), finished(false), jinfo(nullptr), rx_mbuf(nullptr), tx_mbuf(nullptr), num_quanta(0), execution_time(0), arrival_tsc(0), first_run_tsc(0), deadline(0), las_next(nullptr), idle_since(0) {}
 	friend bool operator< (coro_info const& lhs, coro_info const& rhs) {
 	    return lhs.num_quanta > rhs.num_quanta; // so that it's a min heap
     }
-    #endif
 } coro_info_t;
 
-struct rte_rocksdb_hdr {
-        uint32_t id;
-        uint32_t req_type;
-        uint32_t req_size;
-        uint32_t run_ns;
-};
-
-#ifdef LAS
-bool coro_info_ptr_cmp(const coro_info_t* ptr1, const coro_info_t* ptr2) {
-	return *ptr1 < *ptr2;
+bool coro_info_deadline_cmp(const coro_info_t* ptr1, const coro_info_t* ptr2) {
+	return ptr1->deadline > ptr2->deadline; // so that it's a min heap
 }
-#endif
-
-class SimpleStack {
-private:
-    std::size_t     size_;
-
-public:
-    SimpleStack( std::size_t size = STACK_SIZE ) BOOST_NOEXCEPT_OR_NOTHROW :
-        size_( size) {
-    }
 
-    boost::context::stack_context allocate() {
-        void * vp = rte_malloc(nullptr, size_, 0);
-        if (!vp) {
-            throw std::bad_alloc();
-        }
-	boost::context::stack_context sctx;
-        sctx.size = size_;
-        sctx.sp = static_cast< char * >( vp) + sctx.size;
-        return sctx;
-    }
-
-    void deallocate( boost::context::stack_context & sctx) BOOST_NOEXCEPT_OR_NOTHROW {
-        BOOST_ASSERT( sctx.sp);
-        // don't need to do anything, dispatcher is gonna free it
-	void * vp = static_cast< char * >( sctx.sp) - sctx.size;
-        rte_free( vp);
-    }
+/*
+ * The coroutine stacks of one worker, reserved in one piece by the worker
+ * itself once pinned. Release builds take huge pages of the worker's NUMA
+ * node from DPDK. Debug builds map small pages instead, so that a PROT_NONE
+ * guard page below every stack catches overflows; first touch by the pinned
+ * worker keeps those local. All stacks are painted with STACK_PAINT, and
+ * used() tells how deep one has ever grown.
+ */
+struct stack_arena {
+	char* base;
+	size_t stack_size;
+	int num_stacks;
+
+	int init(int num, size_t size) {
+		size_t stride = size + STACK_GUARD_SIZE;
+		num_stacks = num;
+		stack_size = size;
+		#if STACK_GUARD_SIZE > 0
+		base = static_cast<char *>(mmap(nullptr, num * stride, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if(base == MAP_FAILED)
+			return -ENOMEM;
+		for(int i = 0; i < num; i++) {
+			if(mprotect(base + i * stride, STACK_GUARD_SIZE, PROT_NONE) != 0)
+				return -errno;
+		}
+		#else
+		unsigned int cpu, node;
+		int socket = (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)? (int)node : SOCKET_ID_ANY;
+		base = static_cast<char *>(rte_malloc_socket(nullptr, num * stride, 4096, socket));
+		if(base == nullptr)
+			return -ENOMEM;
+		#endif
+		for(int i = 0; i < num; i++) {
+			uint64_t* p = reinterpret_cast<uint64_t *>(stack(i));
+			for(size_t w = 0; w < size / sizeof(uint64_t); w++)
+				p[w] = STACK_PAINT;
+		}
+		return 0;
+	}
+	// lowest address of stack i, it grows down from stack(i) + stack_size
+	char* stack(int i) const {
+		return base + i * (stack_size + STACK_GUARD_SIZE) + STACK_GUARD_SIZE;
+	}
+	// bytes of stack i written so far
+	size_t used(int i) const {
+		const uint64_t* p = reinterpret_cast<const uint64_t *>(stack(i));
+		size_t n = stack_size / sizeof(uint64_t), w = 0;
+		while(w < n && p[w] == STACK_PAINT)
+			w++;
+		return (n - w) * sizeof(uint64_t);
+	}
 };
 
-#ifdef NEW_DISPATCHER
 struct cache_filled_size {
 	uint64_t size;
-	#ifdef MSQ
-	uint64_t sq;
-	char cache_line_filler[CACHE_LINE_SIZE - sizeof(uint64_t) - sizeof(uint64_t)];
-	#else
 	char cache_line_filler[CACHE_LINE_SIZE - sizeof(uint64_t)];
-	#endif
 };
-static struct cache_filled_size *curr_sizes;
-#endif
+/* completed jobs (NEW_DISPATCHER), serviced quanta and coroutines of each worker, packed */
+static struct load_report *load_reports;
+
+struct cache_filled_load {
+	uint64_t load;
+	char cache_line_filler[CACHE_LINE_SIZE - sizeof(uint64_t)];
+};
+/* load of each dispatcher in running jobs per worker (x 1024), published at check-in */
+static struct cache_filled_load *dispatcher_loads;
+/* MPSC rings through which overloaded dispatchers hand packets off to peers */
+static struct rte_ring **handoff_qs;
 
-#ifdef SERVER_LAT
+/* start_tsc of an RX mbuf is its arrival time, see stamp_arrival() */
 struct rte_pktmbuf_pool_private_with_start_tsc {
      uint16_t mbuf_data_room_size;
      uint16_t mbuf_priv_size;
      uint32_t flags;
      uint64_t start_tsc;
  };
-#endif
 
 static rocksdb_t *db;
 
@@ -252,27 +334,150 @@ static uint32_t my_ip;
 
 /* parameters */
 static unsigned int server_port = 8001;
-static unsigned int num_rx_queues = 1;
-static unsigned int num_tx_queues = NUM_WORKER_THREADS;
+static unsigned int num_rx_queues;
+static unsigned int num_tx_queues;
+
+typedef enum sched_policy {
+	SCHED_PS = 0,
+	SCHED_FCFS,
+	SCHED_LAS,
+	SCHED_MLFQ,
+	SCHED_EDF
+} sched_policy_t;
+
+/* quantum and priority (mlfq) and default SLO (edf) of a request class */
+typedef struct job_class {
+	// in cycles, 0 runs to completion
+	uint64_t quantum;
+	// first MLFQ level, 0 is the highest
+	int priority;
+	bool configured;
+	// 0 for slo_us
+	uint32_t slo_us;
+	uint64_t slo_cycles;
+} job_class_t;
+
+typedef enum dispatch_policy {
+	DISPATCH_JSQ = 0,
+	DISPATCH_MSQ,
+	DISPATCH_RAND,
+	// jsq among dispatch_d random workers, power-two with d = 2
+	DISPATCH_JSQ_D,
+	// jsq and msq on the versioned heap rather than the argmin scan
+	DISPATCH_JSQ_HEAP,
+	DISPATCH_MSQ_HEAP,
+	// join-idle-queue
+	DISPATCH_JIQ,
+	NUM_DISPATCH_POLICIES
+} dispatch_policy_t;
+
+/* as --dispatch takes them, by dispatch_policy_t */
+static const char* const dispatch_policy_names[NUM_DISPATCH_POLICIES] = {
+	"jsq", "msq", "rand", "jsq-d", "jsq-heap", "msq-heap", "jiq"
+};
+
+/* set once by parse_args() before any thread is started */
+static int num_worker_threads = NUM_WORKER_THREADS;
+static int num_worker_coros = NUM_WORKER_COROS;
+// a backlogged worker may grow its pool up to this many coroutines, 0 for num_worker_coros
+static int max_worker_coros = 0;
+// extra coroutines idle this long are retired
+static unsigned int coro_cooldown_us = CORO_COOLDOWN_US;
+static uint64_t coro_cooldown_cycles;
+// bytes per coroutine stack, a multiple of 4 KB
+static size_t stack_size = STACK_SIZE;
+static int num_dispatchers = NUM_DISPATCHERS;
+static int quantum_cycle = QUANTUM_CYCLE;
+static int quantum_ic = QUANTUM_IC;
+static unsigned int dispatch_ring_size = DISPATCH_RING_SIZE;
+static uint16_t tx_dequeue_period = TX_DEQUEUE_PERIOD;
+static sched_policy_t sched_policy = SCHED_PS;
+static dispatch_policy_t dispatch_policy = DISPATCH_MSQ;
+static int dispatch_d = DISPATCH_D;
+// run all the policies side by side, SIGUSR1 switches to the next one
+static bool dispatch_live = false;
+// the policy of the live dispatchers, written by the SIGUSR1 handler only
+static int live_dispatch_policy;
+// shift part of each burst to the least loaded peer dispatcher
+static bool dispatcher_rebalance = false;
+// dispatcher-free mode: each worker polls its own RX queue and steals from peers
+static bool work_stealing = false;
+// idle workers may also poll the RX queues of their peers
+static bool steal_nic_queue = false;
+// answer in the RX mbuf instead of a fresh one from tx_mbuf_pool
+static bool in_place_tx = false;
+// drop non-requests in the NIC with rte_flow rules when the PMD supports it
+static bool flow_filter = false;
+// workers reserved for long requests, 0 to treat all requests alike
+static int num_long_workers = 0;
+// bit t set if req_type t is a long request
+static uint64_t long_req_types = (1ULL << 0xB) | (1ULL << 0xD) | (1ULL << 0xF); // ROCKSDB_SCAN, EB_LONG, HB_LONG
+// dispatchers reject requests for a worker with this many jobs, 0 for no limit
+static int admit_max_queue = 0;
+// ... or with this many quanta of its jobs serviced, 0 for no limit
+static int admit_max_quanta = 0;
+// workers reject requests that waited over the target for a whole interval, 0 for off
+static unsigned int codel_target_us = 0;
+static unsigned int codel_interval_us = CODEL_INTERVAL_US;
+static uint64_t codel_target_cycles = 0;
+static uint64_t codel_interval_cycles = 0;
+// unconfigured classes get quantum_cycle at priority 0, see sanity_check()
+static job_class_t job_classes[NUM_JOB_CLASSES];
+static uint32_t slo_us = SLO_US;
+static uint64_t tsc_cycles_per_us;
+// edf answers the jobs that missed their deadline before they start as overloaded
+static bool edf_shed = false;
+
+static inline const job_class_t* job_class_of(uint32_t req_type) {
+	return &job_classes[req_type < NUM_JOB_CLASSES? req_type : NUM_JOB_CLASSES - 1];
+}
+// retune the quantum of each worker online, between quantum_min and quantum_max
+static bool adaptive_quantum = false;
+static int quantum_min = QUANTUM_MIN_CYCLE;
+static int quantum_max = QUANTUM_MAX_CYCLE;
+// per job type latency histograms in the telemetry segment
+static bool latency_hist = false;
+// record the arrival time of each request in its mbuf
+static bool stamp_arrivals = false;
+// RX burst of a dispatcher
+static uint16_t rx_queue_burst_size;
+static unsigned int rx_mbuf_pool_size = RX_MBUF_POOL_SIZE;
+static unsigned int tx_mbuf_pool_size = TX_MBUF_POOL_SIZE;
 
 __thread uint64_t time_interval = 0;
 
 #ifdef RECORD_NUM_PRE
-static struct cache_filled_size num_pres[NUM_WORKER_THREADS];
+static struct cache_filled_size *num_pres;
 #endif
 
 //__thread uint64_t get_start_time, get_end_time; 
 
-__thread coro_t::push_type *curr_yield;
+// the running coroutine, and the worker loop's stack pointer while it runs
+__thread coro_info_t *curr_coro;
+__thread void *worker_sp;
+
+/* backlog of each worker, filled by its owner only and drained by the owner or thieves */
+static struct rte_ring** ws_dispatch_qs;
+struct cache_filled_lock {
+	bool locked;
+	char cache_line_filler[CACHE_LINE_SIZE - sizeof(bool)];
+};
+/* RX queues are not thread-safe, serialize the owner and thieves */
+static struct cache_filled_lock *rx_queue_locks;
+__thread uint32_t steal_seed;
+__thread uint64_t ws_drop_count = 0;
+
+/* shared-memory counters, see telemetry.h */
+static char telemetry_name[NAME_MAX] = TELEMETRY_SHM_NAME;
+static struct telemetry_hdr *telemetry;
+static struct worker_telemetry *worker_tm;
+static struct dispatcher_telemetry *dispatcher_tm;
+
+/* static fields of the responses of this worker, filled once at startup */
+static __thread response_template_t response_template;
 
-#ifdef LAS
 __thread uint32_t quantum_idx = 0;
 __thread uint32_t num_assigned_quanta = 1;
-#endif
-
-#ifdef STACKS_FROM_HUGEPAGE
-char* stacks;
-#endif
 
 static int str_to_ip(const char *str, uint32_t *addr)
 {
@@ -285,6 +490,75 @@ static int str_to_ip(const char *str, uint32_t *addr)
 	return 0;
 }
 
+/*
+ * Let the NIC deliver only requests (our IP, UDP, server_port) and drop
+ * everything else, so that invalid traffic never takes a dispatch ring slot.
+ * Requests are spread over the RX queues as RSS would. Returns 0 if the
+ * rules are in place; otherwise workers keep filtering in software anyway.
+ */
+static int flow_filter_init(uint16_t port, uint16_t n_rxqueues, uint64_t rss_hf)
+{
+	struct rte_flow_attr attr = {};
+	struct rte_flow_item pattern[4] = {};
+	struct rte_flow_action actions[2] = {};
+	struct rte_flow_item_ipv4 ip_spec = {}, ip_mask = {};
+	struct rte_flow_item_udp udp_spec = {}, udp_mask = {};
+	struct rte_flow_action_queue queue = {};
+	struct rte_flow_action_rss rss = {};
+	std::vector<uint16_t> queues(n_rxqueues);
+	struct rte_flow_error error = {};
+	struct rte_flow *accept_flow, *drop_flow;
+
+	attr.ingress = 1;
+	attr.priority = 0;
+	ip_spec.hdr.dst_addr = rte_cpu_to_be_32(my_ip);
+	ip_mask.hdr.dst_addr = rte_cpu_to_be_32(UINT32_MAX);
+	udp_spec.hdr.dst_port = rte_cpu_to_be_16(server_port);
+	udp_mask.hdr.dst_port = rte_cpu_to_be_16(UINT16_MAX);
+	pattern[0].type = RTE_FLOW_ITEM_TYPE_ETH;
+	pattern[1].type = RTE_FLOW_ITEM_TYPE_IPV4;
+	pattern[1].spec = &ip_spec;
+	pattern[1].mask = &ip_mask;
+	pattern[2].type = RTE_FLOW_ITEM_TYPE_UDP;
+	pattern[2].spec = &udp_spec;
+	pattern[2].mask = &udp_mask;
+	pattern[3].type = RTE_FLOW_ITEM_TYPE_END;
+
+	if (n_rxqueues > 1) {
+		for (uint16_t q = 0; q < n_rxqueues; q++)
+			queues[q] = q;
+		rss.types = rss_hf;
+		rss.queue_num = n_rxqueues;
+		rss.queue = queues.data();
+		actions[0].type = RTE_FLOW_ACTION_TYPE_RSS;
+		actions[0].conf = &rss;
+	} else {
+		queue.index = 0;
+		actions[0].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+		actions[0].conf = &queue;
+	}
+	actions[1].type = RTE_FLOW_ACTION_TYPE_END;
+
+	if (rte_flow_validate(port, &attr, pattern, actions, &error) != 0 ||
+	    (accept_flow = rte_flow_create(port, &attr, pattern, actions, &error)) == nullptr) {
+		printf("flow filter: cannot steer requests: %s\n", error.message? error.message : "unsupported");
+		return -1;
+	}
+
+	/* everything else, at a lower priority */
+	attr.priority = 1;
+	pattern[1].type = RTE_FLOW_ITEM_TYPE_END;
+	actions[0].type = RTE_FLOW_ACTION_TYPE_DROP;
+	actions[0].conf = nullptr;
+	if (rte_flow_validate(port, &attr, pattern, actions, &error) != 0 ||
+	    (drop_flow = rte_flow_create(port, &attr, pattern, actions, &error)) == nullptr) {
+		printf("flow filter: cannot drop other traffic: %s\n", error.message? error.message : "unsupported");
+		rte_flow_destroy(port, accept_flow, &error);
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Initializes a given port using global settings and with the RX buffers
  * coming from the mbuf_pool passed as a parameter.
@@ -310,6 +584,19 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool, unsigned int n_rxqueues,
 	if (!rte_eth_dev_is_valid_port(port))
 		return -1;
 
+	rte_eth_dev_info_get(port, &dev_info);
+
+	/* Spread flows over the RX queues, one queue per dispatcher */
+	if (rx_rings > 1) {
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+		port_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+		port_conf.rx_adv_conf.rss_conf.rss_hf = (ETH_RSS_IP | ETH_RSS_UDP) & dev_info.flow_type_rss_offloads;
+		if (port_conf.rx_adv_conf.rss_conf.rss_hf == 0) {
+			printf("error: port %u does not support RSS over IP/UDP\n", (unsigned)port);
+			return -1;
+		}
+	}
+
 	/* Configure the Ethernet device. */
 	retval = rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf);
 	if (retval != 0)
@@ -329,7 +616,6 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool, unsigned int n_rxqueues,
 	}
 
 	/* Enable TX offloading */
-	rte_eth_dev_info_get(0, &dev_info);
 	txconf = &dev_info.default_txconf;
 
 	/* Allocate and set up 1 TX queue per Ethernet port. */
@@ -357,43 +643,113 @@ port_init(uint8_t port, struct rte_mempool *mbuf_pool, unsigned int n_rxqueues,
 	/* Enable RX in promiscuous mode for the Ethernet device. */
 	rte_eth_promiscuous_enable(port);
 
+	if (flow_filter) {
+		if (flow_filter_init(port, rx_rings, port_conf.rx_adv_conf.rss_conf.rss_hf) == 0)
+			printf("flow filter: only requests to port %u reach the RX queues\n", server_port);
+		else
+			printf("flow filter: not supported by %s, filtering in software\n", dev_info.driver_name);
+	}
+
 	return 0;
 }
 
 /*
- * Validate this ethernet header. Return true if this packet is for higher
- * layers, false otherwise.
+ * Byte-wise mask and expected value of the two 16-byte windows of a request
+ * that decide if it is for us: dst MAC, ethertype and IPv4 without options
+ * in the first; protocol, dst IP and UDP dst port in the second.
  */
-static bool check_eth_hdr(const struct rte_mbuf *buf)
-{
-	struct rte_ether_hdr *ptr_mac_hdr;
+typedef struct rx_filter {
+	__m128i mask[2];
+	__m128i expected[2];
+} rx_filter_t;
+#define RX_FILTER_OFFSET1 (RTE_ETHER_HDR_LEN + offsetof(struct rte_ipv4_hdr, next_proto_id) - 1)
 
-	ptr_mac_hdr = rte_pktmbuf_mtod(buf, struct rte_ether_hdr *);
-	if (!rte_is_same_ether_addr(&ptr_mac_hdr->dst_addr, &my_eth)) {
-		/* packet not to our ethernet addr */
-		return false;
-	}
+static rx_filter_t rx_filter;
 
-	if (ptr_mac_hdr->ether_type != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4))
-		/* packet not IPv4 */
-		return false;
+static void set_filter_bytes(uint8_t *mask, uint8_t *expected, size_t offset, const void *value, size_t len)
+{
+	memset(mask + offset, 0xff, len);
+	memcpy(expected + offset, value, len);
+}
 
-	return true;
+/* must be called once my_eth and my_ip are known */
+static void init_rx_filter()
+{
+	alignas(16) uint8_t mask[2][16] = {}, expected[2][16] = {};
+	const uint16_t ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
+	const uint8_t version_ihl = 0x45, proto = IPPROTO_UDP;
+	const uint32_t dst_ip = rte_cpu_to_be_32(my_ip);
+	const uint16_t dst_port = rte_cpu_to_be_16(server_port);
+
+	set_filter_bytes(mask[0], expected[0], offsetof(struct rte_ether_hdr, dst_addr), &my_eth, RTE_ETHER_ADDR_LEN);
+	set_filter_bytes(mask[0], expected[0], offsetof(struct rte_ether_hdr, ether_type), &ether_type, sizeof(ether_type));
+	set_filter_bytes(mask[0], expected[0], RTE_ETHER_HDR_LEN, &version_ihl, sizeof(version_ihl));
+	set_filter_bytes(mask[1], expected[1], RTE_ETHER_HDR_LEN + offsetof(struct rte_ipv4_hdr, next_proto_id) - RX_FILTER_OFFSET1, &proto, sizeof(proto));
+	set_filter_bytes(mask[1], expected[1], RTE_ETHER_HDR_LEN + offsetof(struct rte_ipv4_hdr, dst_addr) - RX_FILTER_OFFSET1, &dst_ip, sizeof(dst_ip));
+	set_filter_bytes(mask[1], expected[1], UDP_HDR_OFFSET + offsetof(struct rte_udp_hdr, dst_port) - RX_FILTER_OFFSET1, &dst_port, sizeof(dst_port));
+	for (int w = 0; w < 2; w++) {
+		rx_filter.mask[w] = _mm_load_si128((const __m128i *) mask[w]);
+		rx_filter.expected[w] = _mm_load_si128((const __m128i *) expected[w]);
+	}
 }
 
 /*
- * Return true if this IP packet is to us and contains a UDP packet,
- * false otherwise.
+ * Return true if this packet is a request to us: long enough to hold the
+ * RocksDB header, IPv4/UDP to our MAC, IP and server_port.
  */
-static bool check_ip_hdr(const struct rte_mbuf *buf)
+static inline bool is_rx_mbuf_valid(const struct rte_mbuf *rx_mbuf)
 {
-	struct rte_ipv4_hdr *ipv4_hdr;
+	const char *pkt = rte_pktmbuf_mtod(rx_mbuf, const char *);
+	__m128i w0, w1;
 
-	ipv4_hdr = rte_pktmbuf_mtod_offset(buf, struct rte_ipv4_hdr *, RTE_ETHER_HDR_LEN);
-	if (ipv4_hdr->dst_addr != rte_cpu_to_be_32(my_ip) || ipv4_hdr->next_proto_id != IPPROTO_UDP)
+	if (unlikely(rte_pktmbuf_data_len(rx_mbuf) < RESPONSE_HDR_LEN))
 		return false;
+	w0 = _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *) pkt), rx_filter.mask[0]), rx_filter.expected[0]);
+	w1 = _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i *) (pkt + RX_FILTER_OFFSET1)), rx_filter.mask[1]), rx_filter.expected[1]);
+	return _mm_movemask_epi8(_mm_and_si128(w0, w1)) == 0xFFFF;
+}
+
+/* requests of a burst that passed validation, as a structure of arrays */
+typedef struct rx_burst {
+	uint16_t nb_valid;
+	uint16_t nb_invalid;
+	struct rte_mbuf **valid;
+	struct rte_mbuf **invalid;
+	uint32_t *req_type;
+	uint32_t *req_size;
+} rx_burst_t;
 
-	return true;
+/*
+ * Validate and parse a whole burst, prefetching PREFETCH_OFFSET packets ahead.
+ * Valid requests keep their order.
+ */
+static void parse_rx_burst(struct rte_mbuf **bufs, uint16_t n, rx_burst_t *burst)
+{
+	const struct rte_rocksdb_hdr *rocksdb_hdr;
+	uint16_t i;
+
+	burst->nb_valid = 0;
+	burst->nb_invalid = 0;
+	// mbuf headers twice as far ahead as the packet data that needs them
+	for (i = 0; i < n && i < 2 * PREFETCH_OFFSET; i++)
+		rte_mbuf_prefetch_part1(bufs[i]);
+	for (i = 0; i < n && i < PREFETCH_OFFSET; i++)
+		rte_prefetch0(rte_pktmbuf_mtod(bufs[i], void *));
+	for (i = 0; i < n; i++) {
+		if (i + 2 * PREFETCH_OFFSET < n)
+			rte_mbuf_prefetch_part1(bufs[i + 2 * PREFETCH_OFFSET]);
+		if (i + PREFETCH_OFFSET < n)
+			rte_prefetch0(rte_pktmbuf_mtod(bufs[i + PREFETCH_OFFSET], void *));
+		if (unlikely(!is_rx_mbuf_valid(bufs[i]))) {
+			burst->invalid[burst->nb_invalid++] = bufs[i];
+			continue;
+		}
+		rocksdb_hdr = rte_pktmbuf_mtod_offset(bufs[i], const struct rte_rocksdb_hdr *, ROCKSDB_HDR_OFFSET);
+		burst->valid[burst->nb_valid] = bufs[i];
+		burst->req_type[burst->nb_valid] = rte_be_to_cpu_32(rocksdb_hdr->req_type);
+		burst->req_size[burst->nb_valid] = rte_be_to_cpu_32(rocksdb_hdr->req_size);
+		burst->nb_valid++;
+	}
 }
 
 /*
@@ -422,20 +778,56 @@ static uint64_t rdtsc(){
     return ((uint64_t)hi << 32) | lo;
 }
 
+static inline void stamp_arrival(struct rte_mbuf **bufs, uint16_t n) {
+	uint64_t start_tsc = rdtsc();
+	for(uint16_t i = 0; i < n; i++) {
+		static_cast< struct rte_pktmbuf_pool_private_with_start_tsc* >(rte_mbuf_to_priv(bufs[i]))->start_tsc = start_tsc;
+	}
+}
+
+static inline uint64_t arrival_tsc(struct rte_mbuf *buf) {
+	return static_cast< struct rte_pktmbuf_pool_private_with_start_tsc* >(rte_mbuf_to_priv(buf))->start_tsc;
+}
+
+/* account the cycles since start to a stage of the worker loop */
+static inline uint64_t telemetry_stage_end(struct worker_telemetry *tm, int stage, uint64_t start) {
+	uint64_t end = rdtsc();
+	telemetry_add(&tm->stage_cycles[stage], end - start);
+	return end;
+}
+
+/* a job finished at now, file it in the histograms of its type */
+static inline void record_latency(struct worker_telemetry *tm, const coro_info_t *c, uint64_t num_quanta, uint64_t now) {
+	struct latency_hist *h = tm->hists[telemetry_job_slot(c->jinfo->jtype)];
+	hist_record(&h[LAT_QUEUEING], c->first_run_tsc - c->arrival_tsc);
+	hist_record(&h[LAT_SERVICE], c->execution_time);
+	hist_record(&h[LAT_QUANTA], num_quanta);
+	hist_record(&h[LAT_SOJOURN], now - c->arrival_tsc);
+}
+
+/* back to the worker loop, which resumes the coroutine right here */
+static inline void coro_yield() {
+	coro_switch(&curr_coro->sp, worker_sp);
+}
+
 void call_the_yield(long ic) {
 	#ifdef TIME_STAGE
 	time_interval = ic;
 	#endif
-	#ifdef LAS
-	quantum_idx++;
-	if(quantum_idx == num_assigned_quanta)
-		(*curr_yield)(nullptr);
-	#else
 	#ifdef TQ_THREAD
         rte_delay_us_block(1);
 	#endif
-	(*curr_yield)(nullptr);
-        #endif
+	coro_yield();
+}
+
+/* LAS lets a job run for several quanta before it yields */
+void call_the_yield_las(long ic) {
+	#ifdef TIME_STAGE
+	time_interval = ic;
+	#endif
+	quantum_idx++;
+	if(quantum_idx == num_assigned_quanta)
+		coro_yield();
 }
 
 void empty_handler(long ic) {
@@ -444,11 +836,15 @@ void empty_handler(long ic) {
 		return;
 }
 
-void coro(int coro_id, job_info_t* &jinfo, coro_t::push_type &yield)
+/*
+ * runs the jobs of one coroutine, first entered when its first job is resumed;
+ * tq_server_lto places probes in it too, RocksDB code like rocksdb_scan() gets inlined here
+ */
+__attribute__((annotate("cheap-preempt")))
+static void coro(void *arg)
 {       
-    std::cout << "[coro]: coro " << coro_id << " is ready!" << std::endl;  
-    /* Suspend here, wait for resume. */
-    yield(&yield);
+    coro_info_t *self = static_cast<coro_info_t *>(arg);
+    job_info_t *jinfo = self->jinfo;
     char *err = nullptr;
     size_t vallen;
     rocksdb_readoptions_t *readoptions = rocksdb_readoptions_create();
@@ -482,19 +878,64 @@ void coro(int coro_id, job_info_t* &jinfo, coro_t::push_type &yield)
 	lat = rdtsc() - jinfo->job_start_time;
         jinfo->rocksdb_hdr->run_ns = rte_cpu_to_be_32(lat);
 	#endif
-    	// TODO: leverage this return value? 
-    	yield(&yield);
+    	self->finished = true;
+    	coro_yield();
     }
     rocksdb_readoptions_destroy(readoptions);
 
 }
 
-static bool is_rx_mbuf_valid(const struct rte_mbuf *rx_mbuf) {
-	// TODO: add UDP check
-	return check_eth_hdr(rx_mbuf) && check_ip_hdr(rx_mbuf);
+/*
+ * Turn a validated request into its response without copying: swap the
+ * addresses and ports, fix up the lengths and trim whatever follows the
+ * RocksDB header. The IP checksum is left to the NIC, as for tx_mbuf_pool.
+ */
+static void make_response_in_place(struct rte_mbuf *rx_mbuf) {
+	struct rte_ether_hdr *eth_hdr = rte_pktmbuf_mtod(rx_mbuf, struct rte_ether_hdr *);
+	struct rte_ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(rx_mbuf, struct rte_ipv4_hdr *, RTE_ETHER_HDR_LEN);
+	struct rte_udp_hdr *udp_hdr = rte_pktmbuf_mtod_offset(rx_mbuf, struct rte_udp_hdr *, RTE_ETHER_HDR_LEN + sizeof(struct rte_ipv4_hdr));
+	const uint32_t pkt_len = RTE_ETHER_HDR_LEN + sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr);
+
+	/* ethernet header, the destination was checked to be us */
+	rte_ether_addr_copy(&eth_hdr->src_addr, &eth_hdr->dst_addr);
+	rte_ether_addr_copy(&my_eth, &eth_hdr->src_addr);
+
+	/* IPv4 header */
+	ipv4_hdr->version_ihl = 0x45;
+	ipv4_hdr->type_of_service = 0;
+	ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
+	ipv4_hdr->time_to_live = 64;
+	ipv4_hdr->hdr_checksum = 0;
+	ipv4_hdr->dst_addr = ipv4_hdr->src_addr;
+	ipv4_hdr->src_addr = rte_cpu_to_be_32(my_ip);
+
+	/* UDP header */
+	udp_hdr->dst_port = udp_hdr->src_port;
+	udp_hdr->src_port = rte_cpu_to_be_16(server_port);
+	udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
+	udp_hdr->dgram_cksum = 0;
+
+	/* the RocksDB header keeps id, req_type and req_size, the caller sets run_ns */
+	if(rx_mbuf->pkt_len > pkt_len)
+		rte_pktmbuf_trim(rx_mbuf, rx_mbuf->pkt_len - pkt_len);
+	rx_mbuf->l2_len = RTE_ETHER_HDR_LEN;
+	rx_mbuf->l3_len = sizeof(struct rte_ipv4_hdr);
+	rx_mbuf->ol_flags = RTE_MBUF_F_TX_IP_CKSUM | RTE_MBUF_F_TX_IPV4;
+}
+
+/* arrival plus the SLO of the request, or of its class if it has none */
+static inline uint64_t request_deadline(struct rte_mbuf *rx_mbuf, uint32_t req_type) {
+	uint64_t slo = job_class_of(req_type)->slo_cycles;
+	if(rte_pktmbuf_data_len(rx_mbuf) >= REQUEST_EXT_HDR_LEN) {
+		struct rte_rocksdb_ext_hdr *ext_hdr = rte_pktmbuf_mtod_offset(rx_mbuf, struct rte_rocksdb_ext_hdr *, ROCKSDB_HDR_OFFSET);
+		uint32_t req_slo_us = rte_be_to_cpu_32(ext_hdr->slo_us);
+		if(req_slo_us != 0)
+			slo = req_slo_us * tsc_cycles_per_us;
+	}
+	return arrival_tsc(rx_mbuf) + slo;
 }
 
-void process_rx_mbuf(struct rte_mbuf *rx_mbuf, coro_info_t* idle_coro, uint32_t queue_size = 0) {
+void process_rx_mbuf(struct rte_mbuf *rx_mbuf, coro_info_t* idle_coro, uint32_t req_type, uint32_t req_size, uint32_t queue_size = 0) {
 
 	//printf("Packet processed!\n");
 	/*struct rte_mbuf *tx_mbuf = rte_pktmbuf_alloc(tx_mbuf_pool);
@@ -502,19 +943,36 @@ void process_rx_mbuf(struct rte_mbuf *rx_mbuf, coro_info_t* idle_coro, uint32_t
 	idle_coro->tx_mbuf = tx_mbuf;*/
 	idle_coro->rx_mbuf = rx_mbuf;
 	idle_coro->num_quanta = 0; 
+	idle_coro->finished = false;
+	idle_coro->execution_time = 0;
+	if(latency_hist)
+		idle_coro->arrival_tsc = arrival_tsc(rx_mbuf);
 
 	/* headers from rx_mbuf */
-	struct rte_ether_hdr * rx_ptr_mac_hdr = rte_pktmbuf_mtod(rx_mbuf, struct rte_ether_hdr *);
-	struct rte_ipv4_hdr * rx_ptr_ipv4_hdr = rte_pktmbuf_mtod_offset(rx_mbuf, struct rte_ipv4_hdr *, RTE_ETHER_HDR_LEN);
-	struct rte_udp_hdr *rx_ptr_udp_hdr = rte_pktmbuf_mtod_offset(rx_mbuf, struct rte_udp_hdr *, RTE_ETHER_HDR_LEN + sizeof(struct rte_ipv4_hdr));
 	// TODO: fix this
 	/*uint32_t *seq_num = rte_pktmbuf_mtod_offset(rx_mbuf, uint32_t *, RTE_ETHER_HDR_LEN + sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr));
 	uint16_t *jtype = rte_pktmbuf_mtod_offset(rx_mbuf, uint16_t *, RTE_ETHER_HDR_LEN + sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr) + sizeof(uint32_t) );
 	idle_coro->jinfo->jtype = static_cast<job_type>(*jtype);
 	idle_coro->jinfo->input_data = rte_pktmbuf_mtod_offset(rx_mbuf, char *, RTE_ETHER_HDR_LEN + sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr) + sizeof(uint32_t) + sizeof(uint16_t));*/
-	struct rte_rocksdb_hdr *rx_ptr_rocksdb_hdr = rte_pktmbuf_mtod_offset(rx_mbuf, struct rte_rocksdb_hdr *, RTE_ETHER_HDR_LEN + sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr));
-	idle_coro->jinfo->jtype = static_cast<job_type>(rte_be_to_cpu_32(rx_ptr_rocksdb_hdr->req_type));
-	idle_coro->jinfo->key = rte_be_to_cpu_32(rx_ptr_rocksdb_hdr->req_size);
+	struct rte_rocksdb_hdr *rx_ptr_rocksdb_hdr = rte_pktmbuf_mtod_offset(rx_mbuf, struct rte_rocksdb_hdr *, ROCKSDB_HDR_OFFSET);
+	idle_coro->jinfo->jtype = static_cast<job_type>(req_type);
+	idle_coro->jinfo->key = req_size;
+
+	if(in_place_tx) {
+		make_response_in_place(rx_mbuf);
+		idle_coro->tx_mbuf = rx_mbuf;
+		#ifdef SERVER_LAT
+		idle_coro->jinfo->job_start_time = arrival_tsc(rx_mbuf);
+		idle_coro->jinfo->rocksdb_hdr = rx_ptr_rocksdb_hdr;
+		#else
+		#ifdef QUEUE_SIZE
+		rx_ptr_rocksdb_hdr->run_ns = rte_cpu_to_be_32(queue_size);
+		#else
+		rx_ptr_rocksdb_hdr->run_ns = 0;
+		#endif
+		#endif
+		return;
+	}
 
 	/* headers of tx_mbuf */	
 	//struct rte_mbuf *tx_mbuf = rte_pktmbuf_copy(rx_mbuf, tx_mbuf_pool, 0, UINT32_MAX);
@@ -523,48 +981,14 @@ void process_rx_mbuf(struct rte_mbuf *rx_mbuf, coro_info_t* idle_coro, uint32_t
 	idle_coro->tx_mbuf = tx_mbuf;
 
 	char *buf_ptr;
-	struct rte_ether_hdr *eth_hdr;
-	struct rte_ipv4_hdr *ipv4_hdr;
-	struct rte_udp_hdr *rte_udp_hdr;
 	struct rte_rocksdb_hdr *rte_rocksdb_hdr;
 
-	/* ethernet header */
-	buf_ptr = rte_pktmbuf_append(tx_mbuf, RTE_ETHER_HDR_LEN);
-	eth_hdr = (struct rte_ether_hdr *) buf_ptr;
-
-	rte_ether_addr_copy(&my_eth, &eth_hdr->src_addr);
-	rte_ether_addr_copy(&rx_ptr_mac_hdr->src_addr, &eth_hdr->dst_addr);
-	eth_hdr->ether_type = rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4);
-
-	/* IPv4 header */
-	buf_ptr = rte_pktmbuf_append(tx_mbuf, sizeof(struct rte_ipv4_hdr));
-	ipv4_hdr = (struct rte_ipv4_hdr *) buf_ptr;
-	ipv4_hdr->version_ihl = 0x45;
-	ipv4_hdr->type_of_service = 0;
-	ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(struct rte_ipv4_hdr) + sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
-	ipv4_hdr->packet_id = rx_ptr_ipv4_hdr->packet_id;
-	ipv4_hdr->fragment_offset = rx_ptr_ipv4_hdr->fragment_offset;
-	ipv4_hdr->time_to_live = 64;
-	ipv4_hdr->next_proto_id = IPPROTO_UDP;
-	ipv4_hdr->hdr_checksum = rx_ptr_ipv4_hdr->hdr_checksum;
-	ipv4_hdr->src_addr = rte_cpu_to_be_32(my_ip);
-	ipv4_hdr->dst_addr = rx_ptr_ipv4_hdr->src_addr;
-
-	/* UDP header */
-	buf_ptr = rte_pktmbuf_append(tx_mbuf, sizeof(struct rte_udp_hdr));
-	rte_udp_hdr = (struct rte_udp_hdr *) buf_ptr;
-	rte_udp_hdr->src_port = rte_cpu_to_be_16(server_port);
-	rte_udp_hdr->dst_port = rx_ptr_udp_hdr->src_port;
-	rte_udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + sizeof(struct rte_rocksdb_hdr));
-	rte_udp_hdr->dgram_cksum = 0;
-	/* RocksDB header */
-	buf_ptr = rte_pktmbuf_append(tx_mbuf, sizeof(struct rte_rocksdb_hdr));
-        rte_rocksdb_hdr = (struct rte_rocksdb_hdr *) buf_ptr;	
-	rte_rocksdb_hdr->id = rx_ptr_rocksdb_hdr->id;
-	rte_rocksdb_hdr->req_type = rx_ptr_rocksdb_hdr->req_type;
-	rte_rocksdb_hdr->req_size = rx_ptr_rocksdb_hdr->req_size;
+	/* all headers at once from the per-worker template */
+	buf_ptr = rte_pktmbuf_append(tx_mbuf, RESPONSE_HDR_LEN);
+	fill_response_hdr_template(buf_ptr, rte_pktmbuf_mtod(rx_mbuf, const char *), &response_template);
+	rte_rocksdb_hdr = (struct rte_rocksdb_hdr *) (buf_ptr + ROCKSDB_HDR_OFFSET);
 	#ifdef SERVER_LAT
-	idle_coro->jinfo->job_start_time = static_cast< struct rte_pktmbuf_pool_private_with_start_tsc* >(rte_mbuf_to_priv(rx_mbuf))->start_tsc;
+	idle_coro->jinfo->job_start_time = arrival_tsc(rx_mbuf);
 	idle_coro->jinfo->rocksdb_hdr = rte_rocksdb_hdr;
 	#else
 	#ifdef QUEUE_SIZE
@@ -628,6 +1052,373 @@ static int rocksdb_init()
   return 0;
 }
 
+/* turn a response into an overloaded one */
+static inline void mark_overloaded(struct rte_mbuf *tx_mbuf) {
+	struct rte_rocksdb_hdr *rocksdb_hdr = rte_pktmbuf_mtod_offset(tx_mbuf, struct rte_rocksdb_hdr *, ROCKSDB_HDR_OFFSET);
+	rocksdb_hdr->req_type |= rte_cpu_to_be_32(RESP_STATUS_OVERLOADED);
+	rocksdb_hdr->run_ns = 0;
+}
+
+/*
+ * Answer requests that are not admitted right away with an overloaded
+ * response so that clients back off; the RX mbufs are the responses.
+ */
+static void reject_requests(uint16_t tx_queue, struct rte_mbuf **bufs, uint16_t n)
+{
+	uint16_t i, nb = 0, nb_tx;
+
+	for(i = 0; i < n; i++) {
+		if(unlikely(!is_rx_mbuf_valid(bufs[i]))) {
+			rte_pktmbuf_free(bufs[i]);
+			continue;
+		}
+		make_response_in_place(bufs[i]);
+		mark_overloaded(bufs[i]);
+		bufs[nb++] = bufs[i];
+	}
+	nb_tx = rte_eth_tx_burst(dpdk_port, tx_queue, bufs, nb);
+	if(unlikely(nb_tx != nb))
+		rte_pktmbuf_free_bulk(&bufs[nb_tx], nb - nb_tx);
+}
+
+/* a worker over either threshold does not get new requests */
+static inline bool worker_overloaded(const worker_info_t *w) {
+	return (admit_max_queue && w->num_running_jobs >= admit_max_queue) ||
+	       (admit_max_quanta && w->serviced_quanta >= admit_max_quanta);
+}
+
+/*
+ * CoDel-style admission at the worker: once requests have waited longer
+ * than the target for a whole interval, reject those above the target
+ * until one comes in below it again.
+ */
+typedef struct codel_state {
+	uint64_t first_above_time;
+	bool rejecting;
+} codel_state_t;
+
+static uint16_t codel_admit(codel_state_t *codel, rx_burst_t *burst, struct rte_mbuf **rejects)
+{
+	uint64_t now = rdtsc(), sojourn;
+	uint16_t i, nb = 0, nb_reject = 0;
+
+	for(i = 0; i < burst->nb_valid; i++) {
+		sojourn = now - arrival_tsc(burst->valid[i]);
+		if(sojourn < codel_target_cycles) {
+			codel->first_above_time = 0;
+			codel->rejecting = false;
+		} else if(codel->first_above_time == 0) {
+			codel->first_above_time = now + codel_interval_cycles;
+		} else if(now >= codel->first_above_time) {
+			codel->rejecting = true;
+		}
+		if(codel->rejecting && sojourn >= codel_target_cycles) {
+			rejects[nb_reject++] = burst->valid[i];
+			continue;
+		}
+		burst->valid[nb] = burst->valid[i];
+		burst->req_type[nb] = burst->req_type[i];
+		burst->req_size[nb] = burst->req_size[i];
+		nb++;
+	}
+	burst->nb_valid = nb;
+	return nb_reject;
+}
+
+static inline uint32_t xorshift32(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/*
+ * Burst from a NIC queue, which may belong to another worker
+ */
+static inline uint16_t ws_rx_burst(uint16_t queue, struct rte_mbuf **bufs, uint16_t n) {
+	uint16_t nb_rx;
+	if(steal_nic_queue) {
+		if(__atomic_test_and_set(&rx_queue_locks[queue].locked, __ATOMIC_ACQUIRE))
+			return 0;
+		nb_rx = rte_eth_rx_burst(dpdk_port, queue, bufs, n);
+		__atomic_clear(&rx_queue_locks[queue].locked, __ATOMIC_RELEASE);
+	} else {
+		nb_rx = rte_eth_rx_burst(dpdk_port, queue, bufs, n);
+	}
+	if(stamp_arrivals)
+		stamp_arrival(bufs, nb_rx);
+	return nb_rx;
+}
+
+/*
+ * Get up to n new jobs: own backlog first, then own RX queue, and steal from
+ * a random peer only if this worker has nothing else to run
+ */
+static uint16_t ws_fetch(int tid, struct rte_mbuf **bufs, uint16_t n, struct rte_mbuf **nic_bufs, bool idle) {
+	struct rte_ring* own_q = ws_dispatch_qs[tid];
+	uint16_t nb, nb_nic, nb_take, nb_backlog;
+
+	// backlog first so that it is not starved by new arrivals
+	nb = rte_ring_dequeue_burst(own_q, (void **)bufs, n, nullptr);
+	if(nb < n) {
+		nb_nic = ws_rx_burst(tid, nic_bufs, WS_RX_BURST_SIZE);
+		nb_take = (nb_nic < n - nb)? nb_nic : n - nb;
+		memcpy(&bufs[nb], nic_bufs, nb_take * sizeof(struct rte_mbuf*));
+		nb += nb_take;
+		if(nb_nic > nb_take) {
+			// the surplus becomes backlog that idle peers can steal
+			nb_backlog = rte_ring_enqueue_burst(own_q, (void **)&nic_bufs[nb_take], nb_nic - nb_take, nullptr);
+			if(unlikely(nb_backlog != nb_nic - nb_take)) {
+				rte_pktmbuf_free_bulk(&nic_bufs[nb_take + nb_backlog], nb_nic - nb_take - nb_backlog);
+				telemetry_add(&worker_tm[tid].drops, nb_nic - nb_take - nb_backlog);
+				ws_drop_count += nb_nic - nb_take - nb_backlog;
+				if(ws_drop_count >= 100000) {
+					std::cout << "Worker " << tid << ": 100K packet drops!" << std::endl;
+					ws_drop_count = 0;
+				}
+			}
+		}
+	}
+	if(nb > 0 || !idle)
+		return nb;
+
+	for(int attempt = 0; attempt < WS_STEAL_ATTEMPTS; attempt++) {
+		int victim = (tid + 1 + xorshift32(&steal_seed) % (num_worker_threads - 1)) % num_worker_threads;
+		// take at most half of the victim's backlog
+		nb_take = (rte_ring_count(ws_dispatch_qs[victim]) + 1) / 2;
+		if(nb_take > 0) {
+			nb = rte_ring_dequeue_burst(ws_dispatch_qs[victim], (void **)bufs, (nb_take < n)? nb_take : n, nullptr);
+			if(nb > 0)
+				return nb;
+		}
+		if(steal_nic_queue) {
+			nb = ws_rx_burst(victim, bufs, n);
+			if(nb > 0)
+				return nb;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Worker scheduling policies, picked once at startup. Each one owns the
+ * queue of busy coroutines and decides how many quanta the next one runs.
+ */
+
+/* processor sharing: new jobs first, preempted jobs go to the back */
+struct ps_sched {
+	std::deque<coro_info_t*> busy_coros;
+
+	static void register_ci() {
+		register_ci_direct(quantum_ic, quantum_cycle, call_the_yield);
+	}
+	// only edf needs a deadline
+	static void stamp(coro_info_t* c, struct rte_mbuf* rx_mbuf, uint32_t req_type) {}
+	bool empty() const { return busy_coros.empty(); }
+	size_t size() const { return busy_coros.size(); }
+	// prioritize new jobs
+	void admit(coro_info_t* c) { busy_coros.push_front(c); }
+	void requeue(coro_info_t* c) { busy_coros.push_back(c); }
+	coro_info_t* pick(uint16_t dispatch_index) {
+		coro_info_t* next_coro = busy_coros.front();
+		busy_coros.pop_front();
+		return next_coro;
+	}
+	// quanta granted to / consumed by the last picked job
+	uint32_t assigned_quanta() const { return 1; }
+	uint32_t used_quanta() const { return 1; }
+};
+
+/* run to completion */
+struct fcfs_sched : ps_sched {
+	static void register_ci() {
+		register_ci_direct(LARGE_QUANTUM, LARGE_QUANTUM, call_the_yield);
+	}
+};
+
+/* least attained service first */
+struct las_sched {
+	las_queue<coro_info_t> busy_coros;
+
+	static void register_ci() {
+		register_ci_direct(quantum_ic, quantum_cycle, call_the_yield_las);
+	}
+	static void stamp(coro_info_t* c, struct rte_mbuf* rx_mbuf, uint32_t req_type) {}
+	bool empty() const { return busy_coros.empty(); }
+	size_t size() const { return busy_coros.size(); }
+	void admit(coro_info_t* c) { busy_coros.push(c); }
+	void requeue(coro_info_t* c) { busy_coros.push(c); }
+	coro_info_t* pick(uint16_t dispatch_index) {
+		coro_info_t* next_coro = busy_coros.pop();
+		coro_info_t* runner_up = busy_coros.min();
+		// run until it catches up with the next least serviced job, FIFO within a shared bucket
+		num_assigned_quanta = (runner_up == nullptr || runner_up->num_quanta <= next_coro->num_quanta)? 1 : runner_up->num_quanta - next_coro->num_quanta + 1;
+		num_assigned_quanta = (num_assigned_quanta + dispatch_index <= DISPATCH_RING_DEQUEUE_PERIOD)? num_assigned_quanta : DISPATCH_RING_DEQUEUE_PERIOD - dispatch_index;
+		quantum_idx = 0;
+		return next_coro;
+	}
+	uint32_t assigned_quanta() const { return num_assigned_quanta; }
+	uint32_t used_quanta() const { return quantum_idx; }
+};
+
+/*
+ * Feedback controller of the quantum of one worker. Over each epoch of
+ * completions it shrinks the quantum when short jobs wait behind long ones
+ * and grows it when preemptions cost more than they buy, then installs it
+ * as the CI cycle interval of this thread.
+ */
+struct quantum_controller {
+	uint64_t quantum;
+	uint64_t epoch_start;
+	uint32_t completions, single_quantum_jobs, preemptions;
+	// jobs waiting for a coroutine or a quantum, summed over the fetches
+	uint64_t waiting, fetches;
+
+	quantum_controller() : quantum(quantum_cycle), epoch_start(0) { reset(); }
+	void reset() {
+		completions = single_quantum_jobs = preemptions = 0;
+		waiting = fetches = 0;
+		epoch_start = rdtsc();
+	}
+	void on_preemption() { preemptions++; }
+	void on_fetch(uint64_t busy, uint64_t backlog) {
+		waiting += busy + backlog;
+		fetches++;
+	}
+	// returns true once a new quantum is installed
+	bool on_completion(uint32_t num_quanta) {
+		completions++;
+		if(num_quanta <= 1)
+			single_quantum_jobs++;
+		if(completions < QUANTUM_EPOCH_JOBS)
+			return false;
+		return adjust();
+	}
+	bool adjust() {
+		uint64_t cycles = rdtsc() - epoch_start, next = quantum;
+		bool queueing = fetches > 0 && waiting > fetches;
+		// mostly short jobs, but some long ones holding them up
+		bool mixed = single_quantum_jobs * 2 >= completions && single_quantum_jobs < completions;
+
+		if((uint64_t)preemptions * PREEMPTION_COST_CYCLES * 100 > cycles * PREEMPTION_OVERHEAD_PCT)
+			next = quantum + quantum / 4;
+		else if(queueing && mixed)
+			next = quantum - quantum / 4;
+		else if(!queueing && preemptions > 0)
+			// nobody is waiting, preempting only costs
+			next = quantum + quantum / 8;
+		next = std::max<uint64_t>(quantum_min, std::min<uint64_t>(quantum_max, next));
+		reset();
+		if(next == quantum)
+			return false;
+		quantum = next;
+		// same split as register_ci_direct()
+		ci_cycles_interval = quantum;
+		ci_cycles_threshold = 0.9 * quantum;
+		return true;
+	}
+};
+
+/*
+ * Multi-level feedback queue: a job enters at the level of its class and
+ * drops one level every time its attained service doubles; the highest
+ * non-empty level runs first, FIFO within a level. Each class also has its
+ * own quantum, installed as the CI threshold right before it is resumed.
+ */
+struct mlfq_sched {
+	std::deque<coro_info_t*> levels[MLFQ_LEVELS];
+	// bit l set if levels[l] is not empty
+	uint32_t nonempty;
+	size_t num_busy;
+	uint64_t installed_quantum;
+
+	mlfq_sched() : nonempty(0), num_busy(0), installed_quantum(quantum_cycle) {}
+	static void register_ci() {
+		register_ci_direct(quantum_ic, quantum_cycle, call_the_yield);
+	}
+	static void stamp(coro_info_t* c, struct rte_mbuf* rx_mbuf, uint32_t req_type) {}
+	static int level(const coro_info_t* c) {
+		// num_quanta in [2^(k-1), 2^k) is k levels down
+		int l = job_class_of(c->jinfo->jtype)->priority + (c->num_quanta == 0? 0 : 64 - __builtin_clzll(c->num_quanta));
+		return (l < MLFQ_LEVELS)? l : MLFQ_LEVELS - 1;
+	}
+	void push(coro_info_t* c) {
+		int l = level(c);
+		levels[l].push_back(c);
+		nonempty |= 1u << l;
+		num_busy++;
+	}
+	bool empty() const { return num_busy == 0; }
+	size_t size() const { return num_busy; }
+	void admit(coro_info_t* c) { push(c); }
+	void requeue(coro_info_t* c) { push(c); }
+	coro_info_t* pick(uint16_t dispatch_index) {
+		int l = __builtin_ctz(nonempty);
+		coro_info_t* next_coro = levels[l].front();
+		levels[l].pop_front();
+		if(levels[l].empty())
+			nonempty &= ~(1u << l);
+		num_busy--;
+		install_quantum(job_class_of(next_coro->jinfo->jtype)->quantum);
+		return next_coro;
+	}
+	void install_quantum(uint64_t quantum) {
+		if(quantum == installed_quantum)
+			return;
+		installed_quantum = quantum;
+		// same split as register_ci_direct()
+		ci_cycles_interval = quantum? quantum : LARGE_QUANTUM;
+		ci_cycles_threshold = 0.9 * ci_cycles_interval;
+	}
+	uint32_t assigned_quanta() const { return 1; }
+	uint32_t used_quanta() const { return 1; }
+};
+
+/*
+ * Earliest deadline first, preempting at quantum granularity. Jobs that have
+ * not started yet are kept apart, so that shedding them never waits behind a
+ * started one, which can't be stopped.
+ */
+struct edf_sched {
+	typedef std::priority_queue<coro_info_t*, std::vector<coro_info_t*>, decltype(&coro_info_deadline_cmp)> deadline_heap;
+	deadline_heap unstarted, started;
+
+	edf_sched() : unstarted(coro_info_deadline_cmp), started(coro_info_deadline_cmp) {}
+	static void register_ci() {
+		register_ci_direct(quantum_ic, quantum_cycle, call_the_yield);
+	}
+	static void stamp(coro_info_t* c, struct rte_mbuf* rx_mbuf, uint32_t req_type) {
+		c->deadline = request_deadline(rx_mbuf, req_type);
+	}
+	bool empty() const { return unstarted.empty() && started.empty(); }
+	size_t size() const { return unstarted.size() + started.size(); }
+	void admit(coro_info_t* c) { unstarted.push(c); }
+	void requeue(coro_info_t* c) { started.push(c); }
+	coro_info_t* pick(uint16_t dispatch_index) {
+		deadline_heap& h = (started.empty() || (!unstarted.empty() && unstarted.top()->deadline < started.top()->deadline))? unstarted : started;
+		coro_info_t* next_coro = h.top();
+		h.pop();
+		return next_coro;
+	}
+	// the earliest job that missed its deadline before it started
+	coro_info_t* take_expired(uint64_t now) {
+		if(unstarted.empty() || unstarted.top()->deadline > now)
+			return nullptr;
+		coro_info_t* c = unstarted.top();
+		unstarted.pop();
+		return c;
+	}
+	uint32_t assigned_quanta() const { return 1; }
+	uint32_t used_quanta() const { return 1; }
+};
+
+/* only edf knows deadlines */
+template <class Sched>
+static inline coro_info_t* take_expired(Sched& s, uint64_t now) { return nullptr; }
+static inline coro_info_t* take_expired(edf_sched& s, uint64_t now) { return s.take_expired(now); }
+
+template <class Sched, bool WorkStealing>
 void* worker(void* arg) {
     
 	rte_thread_register();
@@ -635,30 +1426,58 @@ void* worker(void* arg) {
 
     worker_arg_t* worker_arg = static_cast<worker_arg_t*>(arg);
     int tid = worker_arg->wid;
-    pin_to_cpu(tid + 1);
+    pin_to_cpu(tid + (WorkStealing? 0 : num_dispatchers));
 
     cp_pid = gettid();
     // per thread
-    #ifdef FCFS
-    register_ci_direct(LARGE_QUANTUM, LARGE_QUANTUM, call_the_yield);
-    #else
-    register_ci_direct(QUANTUM_IC, QUANTUM_CYCLE, call_the_yield);
-    #endif
+    Sched::register_ci();
+    init_response_template(&response_template, &my_eth, my_ip, server_port);
 
     struct rte_ring* rx_mbuf_dispatch_q = worker_arg->rx_mbuf_dispatch_q;
     #ifndef NEW_DISPATCHER 
     struct rte_ring* rx_mbuf_return_q = worker_arg->rx_mbuf_return_q;
     #endif
-    #ifdef STACKS_FROM_HUGEPAGE
-    char* stack_pool = worker_arg->stack_pool;
-    #endif
-    struct rte_mbuf **rx_bufs = static_cast<struct rte_mbuf **>(rte_malloc(nullptr, NUM_WORKER_COROS * sizeof(struct rte_mbuf*), 0));
+    // stacks of all the coroutines the pool may grow to, reserved up front
+    stack_arena stacks;
+    if(stacks.init(max_worker_coros, stack_size) != 0)
+    	rte_exit(EXIT_FAILURE, "Worker %d cannot reserve stacks for %d coroutines\n", tid, max_worker_coros);
+    // deepest stack seen, one stack is scanned every STACK_SCAN_PERIOD completions
+    size_t stack_used = 0, used;
+    uint32_t scan_completions = 0;
+    int scan_coro = 0;
+    struct rte_mbuf **rx_bufs = static_cast<struct rte_mbuf **>(rte_malloc(nullptr, max_worker_coros * sizeof(struct rte_mbuf*), 0));
     struct rte_mbuf **return_rx_bufs = static_cast<struct rte_mbuf **>(rte_malloc(nullptr, RETURN_RING_BURST_SIZE * sizeof(struct rte_mbuf*), 0));
     struct rte_mbuf **tx_bufs = static_cast<struct rte_mbuf **>(rte_malloc(nullptr, TX_QUEUE_BURST_SIZE * sizeof(struct rte_mbuf*), 0));
+    struct rte_mbuf **nic_bufs = nullptr;
+    if(WorkStealing) {
+        nic_bufs = static_cast<struct rte_mbuf **>(rte_malloc(nullptr, WS_RX_BURST_SIZE * sizeof(struct rte_mbuf*), 0));
+        steal_seed = tid + 1;
+    }
+    // new requests wait here, dispatched or taken from the NIC
+    struct rte_ring* backlog_q = WorkStealing? ws_dispatch_qs[tid] : rx_mbuf_dispatch_q;
+   	
+    struct worker_telemetry *tm = &worker_tm[tid];
+    quantum_controller qc;
+    telemetry_set(&tm->quantum_cycles, quantum_cycle);
+    uint64_t stage_start = 0, run_start = 0, run_end = 0, expired_now;
+    uint32_t loop_count = 0, backlog;
+    bool time_stages;
+
+    codel_state_t codel = {};
+    uint16_t nb_reject;
+    uint64_t reject_count = 0;
+
+    /* parse stage output, a burst is at most one request per coroutine */
+    rx_burst_t burst;
+    std::vector<struct rte_mbuf*> burst_valid(max_worker_coros), burst_invalid(max_worker_coros);
+    std::vector<uint32_t> burst_req_type(max_worker_coros), burst_req_size(max_worker_coros);
+    burst.valid = burst_valid.data();
+    burst.invalid = burst_invalid.data();
+    burst.req_type = burst_req_type.data();
+    burst.req_size = burst_req_size.data();
    	
-   	coro_t::pull_type *worker_coros = static_cast<coro_t::pull_type*>(rte_malloc(nullptr, NUM_WORKER_COROS * sizeof(coro_t::pull_type), 0));
-    coro_info_t *worker_coro_infos = static_cast<coro_info_t *>(rte_malloc(nullptr, NUM_WORKER_COROS * sizeof(coro_info_t), 0));
-    job_info_t *job_infos = static_cast<job_info*>(rte_malloc(nullptr, NUM_WORKER_COROS * sizeof(job_info_t), 0));
+    coro_info_t *worker_coro_infos = static_cast<coro_info_t *>(rte_malloc(nullptr, max_worker_coros * sizeof(coro_info_t), 0));
+    job_info_t *job_infos = static_cast<job_info*>(rte_malloc(nullptr, max_worker_coros * sizeof(job_info_t), 0));
 
    	uint16_t num_rx_buf, nb_tx, nb_return;
    	int i; 
@@ -667,14 +1486,21 @@ void* worker(void* arg) {
 	uint8_t port = dpdk_port;
 	coro_info_t* idle_coro, next_coro;
 	std::vector<coro_info_t*> idle_coros;
-	idle_coros.reserve(NUM_WORKER_COROS);
-
-	// flexibility in which end to use
-	#ifdef LAS
-	std::priority_queue<coro_info_t*, std::vector<coro_info_t*>, decltype(&coro_info_ptr_cmp)> busy_coros(coro_info_ptr_cmp);
-	#else
-	std::deque<coro_info_t*> busy_coros;
-    #endif
+	idle_coros.reserve(max_worker_coros);
+
+	/*
+	 * Coroutines past num_worker_coros are created when the backlog outgrows
+	 * the idle ones and retired once idle for coro_cooldown_cycles. Retired
+	 * ones keep their stack and are reused before a new one is created.
+	 */
+	bool dynamic_coros = max_worker_coros > num_worker_coros;
+	int num_coros = num_worker_coros, num_created_coros = 0;
+	std::vector<coro_info_t*> retired_coros;
+	retired_coros.reserve(max_worker_coros);
+	uint32_t fetch_limit;
+	uint64_t fetch_now;
+
+	Sched busy_coros;
 
     #ifdef TIME_STAGE
     uint64_t start, stage1_end, stage2_end, stage3_end, stage4_end, yield_end_time, stage1_cycles = 0, stage2_cycles = 0, stage3_cycles = 0, stage4_cycles = 0, num_samples = 0, total_work_time = 0;
@@ -688,67 +1514,120 @@ void* worker(void* arg) {
 
     printf("Worker %d initialize all worker coroutines\n", tid);
 
-    for(int coro_id = 0; coro_id < NUM_WORKER_COROS; coro_id++) {
-    	#ifdef STACKS_FROM_HUGEPAGE
-    	worker_coros[coro_id] = coro_t::pull_type(SimpleStack(stack_pool), boost::bind(coro, coro_id, &job_infos[coro_id], _1));
-    	stack_pool += STACK_SIZE;
+    // the next coroutine runs on the next stack of the arena
+    auto create_coro = [&]() {
+    	int coro_id = num_created_coros++;
+    	coro_info_t *c = &worker_coro_infos[coro_id];
+    	c->jinfo = &job_infos[coro_id];
+    	c->finished = false;
+    	c->idle_since = 0;
+    	c->sp = coro_init(stacks.stack(coro_id) + stack_size, coro, c);
+    	std::cout << "[coro]: coro " << coro_id << " is ready!" << std::endl;
+    	return c;
+    };
+
+    for(int coro_id = 0; coro_id < num_worker_coros; coro_id++) {
+    	idle_coros.push_back(create_coro());
+    }
+    telemetry_set(&tm->coros, num_coros);
+    // TX and return bursts, also flushed early when shedding fills them
+    auto flush_tx = [&]() {
+    	nb_tx = rte_eth_tx_burst(port, tid, tx_bufs, tx_buf_idx);
+    	telemetry_add(&tm->tx_pkts, nb_tx);
+    	if (unlikely(nb_tx != tx_buf_idx)) {
+    		printf("error: worker %d could not transmit all packets: %d %d\n", tid, tx_buf_idx, nb_tx);
+    		// don't leak them, in place they would drain the RX pool
+    		rte_pktmbuf_free_bulk(&tx_bufs[nb_tx], tx_buf_idx - nb_tx);
+    		telemetry_add(&tm->drops, tx_buf_idx - nb_tx);
+    	}
+    	tx_buf_idx = 0;
+    	flush_index = 0;
+    };
+    auto flush_return = [&]() {
+    	#ifdef NEW_DISPATCHER
+    	rte_pktmbuf_free_bulk(return_rx_bufs, return_rx_buf_idx);
     	#else
-    	worker_coros[coro_id] = coro_t::pull_type(SimpleStack(), boost::bind(coro, coro_id, &job_infos[coro_id], _1));
+    	nb_return = rte_ring_enqueue_burst(rx_mbuf_return_q, (void **)return_rx_bufs, return_rx_buf_idx, nullptr);
+    	if (unlikely(nb_return != return_rx_buf_idx)) {
+    		printf("error: worker %d could not return all rx-mbufs: %d %d\n", tid, return_rx_buf_idx, nb_return);
+    		abort();
+    	}
     	#endif
-    	worker_coro_infos[coro_id].coro = &worker_coros[coro_id];
-    	worker_coro_infos[coro_id].yield = static_cast<coro_t::push_type*>(worker_coros[coro_id].get()); 
-    	worker_coro_infos[coro_id].jinfo = &job_infos[coro_id];
-    }
-
-    for(int coro_id = 0; coro_id < NUM_WORKER_COROS; coro_id++) {
-    	idle_coros.push_back(&worker_coro_infos[coro_id]);
-    }
+    	return_rx_buf_idx = 0;
+    };
+    // what the dispatcher sees of this worker, published on completions, pool
+    // changes and every LOAD_REPORT_SQ_STEP quanta, at most once per loop iteration
+    uint32_t num_completed = 0, num_serviced = 0, published_serviced = 0;
+    bool report_dirty = true;
 
     for (;;) {
     	#ifdef TIME_STAGE
     	start = rdtsc_w_lfence();
     	#endif
+		time_stages = (++loop_count % TELEMETRY_STAGE_SAMPLE_PERIOD) == 0;
+		if(unlikely(time_stages))
+			stage_start = rdtsc();
 	    // whether to force a enqueue to return rx mbuf or send tx mbuf
 		force_flush = false;
 		// whether to force a dequeue to read new rx mbuf
 		force_dispatch = false;
 
+		if(edf_shed) {
+			// answer the jobs that are too late to be useful without running them
+			expired_now = rdtsc();
+			while((idle_coro = take_expired(busy_coros, expired_now)) != nullptr) {
+				if(tx_buf_idx == TX_QUEUE_BURST_SIZE)
+					flush_tx();
+				if(return_rx_buf_idx == RETURN_RING_BURST_SIZE)
+					flush_return();
+				mark_overloaded(idle_coro->tx_mbuf);
+				if(!in_place_tx)
+					return_rx_bufs[return_rx_buf_idx++] = idle_coro->rx_mbuf;
+				tx_bufs[tx_buf_idx++] = idle_coro->tx_mbuf;
+				idle_coro->idle_since = expired_now;
+				idle_coros.push_back(idle_coro);
+				num_completed++;
+				report_dirty = true;
+				telemetry_add(&tm->rejects, 1);
+			}
+			// room for the response of the job run below
+			if(tx_buf_idx == TX_QUEUE_BURST_SIZE)
+				flush_tx();
+			if(return_rx_buf_idx == RETURN_RING_BURST_SIZE)
+				flush_return();
+		}
+
 		if(!busy_coros.empty()) {
 			
-			#ifdef LAS
-			coro_info_t* next_coro = busy_coros.top();
-			busy_coros.pop();
-			num_assigned_quanta = busy_coros.top()->num_quanta - next_coro->num_quanta + 1; 
-			num_assigned_quanta = (num_assigned_quanta + dispatch_index <= DISPATCH_RING_DEQUEUE_PERIOD)? num_assigned_quanta : DISPATCH_RING_DEQUEUE_PERIOD - dispatch_index;
-			quantum_idx = 0;
-			#else
-			coro_info_t* next_coro = busy_coros.front();
-			busy_coros.pop_front();
-			#endif
+			coro_info_t* next_coro = busy_coros.pick(dispatch_index);
 		    // set the yield function
-		    curr_yield = next_coro->yield;
-		    if(next_coro->num_quanta == 0)
-		    	LastCycleTS = rdtsc();
+		    curr_coro = next_coro;
+		    if(latency_hist)
+		    	run_start = rdtsc();
+		    if(next_coro->num_quanta == 0) {
+		    	LastCycleTS = latency_hist? run_start : rdtsc();
+		    	next_coro->first_run_tsc = LastCycleTS;
+		    }
 		    
 		    // resume next_coro
-		    (*(next_coro->coro))();
+		    coro_switch(&worker_sp, next_coro->sp);
+		    if(latency_hist) {
+		    	run_end = rdtsc();
+		    	next_coro->execution_time += run_end - run_start;
+		    }
 		    
 		    // check whether next_coro finish
-		    if(next_coro->coro->get() == nullptr) {
+		    if(!next_coro->finished) {
 		    	// not finished
-		    	#ifdef LAS
-			next_coro->num_quanta += num_assigned_quanta;
-			busy_coros.push(next_coro);
-			#ifdef MSQ
-			curr_sizes[tid].sq += num_assigned_quanta;
-			#endif
-			#else
-			next_coro->num_quanta ++;
-		    	busy_coros.push_back(next_coro);
-			#ifdef MSQ
-                        curr_sizes[tid].sq ++;
-                        #endif
-		    	#endif
+			next_coro->num_quanta += busy_coros.assigned_quanta();
+			busy_coros.requeue(next_coro);
+			num_serviced += busy_coros.assigned_quanta();
+			if(num_serviced - published_serviced >= LOAD_REPORT_SQ_STEP)
+				report_dirty = true;
+
+			telemetry_add(&tm->preemptions[telemetry_job_slot(next_coro->jinfo->jtype)], 1);
+			if(adaptive_quantum)
+				qc.on_preemption();
 
 			#ifdef RECORD_NUM_PRE
 			if(likely(next_coro->jinfo->jtype == ROCKSDB_SCAN))
@@ -757,27 +1636,44 @@ void* worker(void* arg) {
 		    }
 		    else {
 		    	// finished 
-		    	return_rx_bufs[return_rx_buf_idx++] = next_coro->rx_mbuf;
+		    	// in place, the rx_mbuf itself is the response and is freed on TX completion
+		    	if(!in_place_tx)
+		    		return_rx_bufs[return_rx_buf_idx++] = next_coro->rx_mbuf;
 		    	tx_bufs[tx_buf_idx++] = next_coro->tx_mbuf;
 		    	//total_execution_cycles += get_end_time - get_start_time; 
 		    	//total_num_quanta += next_coro->num_quanta + 1;
 		    	//finished_jobs++;
 		
+		    	if(dynamic_coros)
+		    		next_coro->idle_since = latency_hist? run_end : rdtsc();
 		    	idle_coros.push_back(next_coro);
-			#ifdef NEW_DISPATCHER
-			curr_sizes[tid].size++;
-			#ifdef MSQ
-			curr_sizes[tid].sq -= next_coro->num_quanta;
-			#endif
-			#endif
+			num_completed++;
+			num_serviced -= next_coro->num_quanta;
+			report_dirty = true;
+			telemetry_add(&tm->completions[telemetry_job_slot(next_coro->jinfo->jtype)], 1);
+			telemetry_add(&tm->quanta[telemetry_job_slot(next_coro->jinfo->jtype)], next_coro->num_quanta + busy_coros.assigned_quanta());
+			if(latency_hist)
+				record_latency(tm, next_coro, next_coro->num_quanta + busy_coros.assigned_quanta(), run_end);
+			if(adaptive_quantum && qc.on_completion(next_coro->num_quanta + busy_coros.assigned_quanta()))
+				telemetry_set(&tm->quantum_cycles, qc.quantum);
+			if(unlikely(++scan_completions == STACK_SCAN_PERIOD)) {
+				scan_completions = 0;
+				scan_coro = (scan_coro + 1) % num_created_coros;
+				used = stacks.used(scan_coro);
+				if(used > stack_used) {
+					stack_used = used;
+					telemetry_set(&tm->stack_used, stack_used);
+					printf("Worker %d: coroutine stacks used up to %zu of %zu bytes\n", tid, stack_used, stack_size);
+				}
+			}
 		    }
-		    #ifdef LAS
-		    dispatch_index += quantum_idx; 
-		    flush_index += quantum_idx;
-		    #else
-		    dispatch_index++;
-		    flush_index++;
-		    #endif
+		    dispatch_index += busy_coros.used_quanta();
+		    flush_index += busy_coros.used_quanta();
+		}
+		if(report_dirty) {
+			load_report_publish(&load_reports[tid], num_completed, num_serviced, num_coros);
+			published_serviced = num_serviced;
+			report_dirty = false;
 		}
 
 		if(busy_coros.empty()){
@@ -788,76 +1684,113 @@ void* worker(void* arg) {
 		#ifdef TIME_STAGE
     	stage1_end = rdtsc_w_lfence();
     	#endif
+		if(unlikely(time_stages))
+			stage_start = telemetry_stage_end(tm, STAGE_RUN, stage_start);
 
-		if(force_dispatch || (dispatch_index >= DISPATCH_RING_DEQUEUE_PERIOD && !idle_coros.empty())) {
+		// one request per idle coroutine, and per one the pool can still grow by
+		fetch_limit = idle_coros.size() + (max_worker_coros - num_coros);
+		if(force_dispatch || (dispatch_index >= DISPATCH_RING_DEQUEUE_PERIOD && fetch_limit > 0)) {
 	    	// get new jobs if (1) there are idle cores and (2) dequeue_period is up
-			num_rx_buf = rte_ring_dequeue_burst(rx_mbuf_dispatch_q, (void **)rx_bufs, idle_coros.size(), nullptr); 
+			if(WorkStealing)
+				num_rx_buf = ws_fetch(tid, rx_bufs, fetch_limit, nic_bufs, busy_coros.empty());
+			else
+				num_rx_buf = rte_ring_dequeue_burst(rx_mbuf_dispatch_q, (void **)rx_bufs, fetch_limit, nullptr); 
 			#ifdef QUEUE_SIZE
 			queue_size = busy_coros.size();
 			#endif
-			/*for(i = 0; i < num_rx_buf; i++) {
-				if(i + PREFETCH_OFFSET < num_rx_buf) {
-					rte_mbuf_prefetch_part1(rx_bufs[i + PREFETCH_OFFSET]);
-				}*/
-			for(i = num_rx_buf - 1; i >= 0; i--) {
-				if(i >= PREFETCH_OFFSET) {
-                                        rte_mbuf_prefetch_part1(rx_bufs[i - PREFETCH_OFFSET]);
-                                }
-				if(unlikely(!is_rx_mbuf_valid(rx_bufs[i]))) {
-					// invalid packet, free the rx_mbuf
-					// TODO: fix this
-					if(return_rx_buf_idx < RETURN_RING_BURST_SIZE) {
-						return_rx_bufs[return_rx_buf_idx++] = rx_bufs[i];
+			telemetry_add(&tm->rx_pkts, num_rx_buf);
+			backlog = rte_ring_count(backlog_q);
+			telemetry_set(&tm->ring_occupancy, backlog);
+			telemetry_set(&tm->busy_coros, busy_coros.size());
+			if(adaptive_quantum)
+				qc.on_fetch(busy_coros.size(), backlog);
+			parse_rx_burst(rx_bufs, num_rx_buf, &burst);
+			if(burst.nb_invalid > 0)
+				telemetry_add(&tm->drops, burst.nb_invalid);
+			if(codel_target_cycles) {
+				nb_reject = codel_admit(&codel, &burst, rx_bufs);
+				if(nb_reject > 0) {
+					reject_requests(tid, rx_bufs, nb_reject);
+					telemetry_add(&tm->rejects, nb_reject);
+					reject_count += nb_reject;
+					if(reject_count >= 100000) {
+						std::cout << "Worker " << tid << ": 100K requests rejected!" << std::endl;
+						reject_count = 0;
+					}
+				}
+			}
+			for(i = 0; i < burst.nb_invalid; i++) {
+				// invalid packet, free the rx_mbuf
+				// TODO: fix this
+				if(in_place_tx) {
+					rte_pktmbuf_free(burst.invalid[i]);
+				} else if(return_rx_buf_idx < RETURN_RING_BURST_SIZE) {
+					return_rx_bufs[return_rx_buf_idx++] = burst.invalid[i];
+				}
+			}
+			// backwards, so that admitting to the front keeps the arrival order
+			for(i = burst.nb_valid - 1; i >= 0; i--) {
+				if(likely(!idle_coros.empty())) {
+					idle_coro = idle_coros.back();
+					idle_coros.pop_back();
+				} else {
+					// grow, within fetch_limit
+					if(retired_coros.empty()) {
+						idle_coro = create_coro();
+					} else {
+						idle_coro = retired_coros.back();
+						retired_coros.pop_back();
 					}
-					continue;
-				} 
-				idle_coro = idle_coros.back();
-				idle_coros.pop_back();
+					num_coros++;
+					report_dirty = true;
+					telemetry_set(&tm->coros, num_coros);
+				}
 				#ifdef QUEUE_SIZE
-				process_rx_mbuf(rx_bufs[i], idle_coro, queue_size);
+				process_rx_mbuf(burst.valid[i], idle_coro, burst.req_type[i], burst.req_size[i], queue_size);
 				#else
-				process_rx_mbuf(rx_bufs[i], idle_coro);
+				process_rx_mbuf(burst.valid[i], idle_coro, burst.req_type[i], burst.req_size[i]);
 				#endif
-				// prioritize new jobs
-				#ifdef LAS
-				busy_coros.push(idle_coro);
-				#else
-	  			busy_coros.push_front(idle_coro);
-	  			#endif
+				Sched::stamp(idle_coro, burst.valid[i], burst.req_type[i]);
+	  			busy_coros.admit(idle_coro);
 	  		}
+			// the coroutine idle the longest is at the front
+			if(dynamic_coros && num_coros > num_worker_coros && !idle_coros.empty()) {
+				fetch_now = rdtsc();
+				if(fetch_now - idle_coros.front()->idle_since >= coro_cooldown_cycles) {
+					retired_coros.push_back(idle_coros.front());
+					idle_coros.erase(idle_coros.begin());
+					num_coros--;
+					report_dirty = true;
+					telemetry_set(&tm->coros, num_coros);
+				}
+			}
 			dispatch_index = 0;
 		} 
 
 		#ifdef TIME_STAGE
     	stage2_end = rdtsc_w_lfence();
     	#endif
+		if(unlikely(time_stages))
+			stage_start = telemetry_stage_end(tm, STAGE_FETCH, stage_start);
 
 	    /* TX path */
-	    if(force_flush || (flush_index >= TX_DEQUEUE_PERIOD && tx_buf_idx != 0) || tx_buf_idx == TX_QUEUE_BURST_SIZE) {
-	  		nb_tx = rte_eth_tx_burst(port, tid, tx_bufs, tx_buf_idx);
-	  		if (unlikely(nb_tx != tx_buf_idx))
-				printf("error: worker %d could not transmit all packets: %d %d\n", tid, tx_buf_idx, nb_tx);
-	  		tx_buf_idx = 0;
-			flush_index = 0;
-	    }
+	    if(force_flush || (flush_index >= tx_dequeue_period && tx_buf_idx != 0) || tx_buf_idx == TX_QUEUE_BURST_SIZE)
+	    	flush_tx();
 
 	    #ifdef TIME_STAGE
     	stage3_end = rdtsc_w_lfence();
     	#endif
+		if(unlikely(time_stages))
+			stage_start = telemetry_stage_end(tm, STAGE_TX, stage_start);
 
 	    /* return rx_mbuf */
-	    if(force_flush || return_rx_buf_idx == RETURN_RING_BURST_SIZE) {
-		#ifdef NEW_DISPATCHER
-		rte_pktmbuf_free_bulk(return_rx_bufs, return_rx_buf_idx);
-		#else
-		nb_return = rte_ring_enqueue_burst(rx_mbuf_return_q, (void **)return_rx_bufs, return_rx_buf_idx, nullptr);
-	    	if (unlikely(nb_return != return_rx_buf_idx)) {
-	    		printf("error: worker %d could not return all rx-mbufs: %d %d\n", tid, return_rx_buf_idx, nb_return);
-	    		abort();
-	    	}
-		#endif
-	    	return_rx_buf_idx = 0;
-	    }
+	    if(force_flush || return_rx_buf_idx == RETURN_RING_BURST_SIZE)
+	    	flush_return();
+
+		if(unlikely(time_stages)) {
+			telemetry_stage_end(tm, STAGE_RETURN, stage_start);
+			telemetry_add(&tm->stage_samples, 1);
+		}
 
 	    #ifdef TIME_STAGE
     	stage4_end = rdtsc_w_lfence();
@@ -890,170 +1823,413 @@ void* worker(void* arg) {
 	}
 }
 
-static size_t round_to_huge_page_size(size_t n) {
-    return (((n - 1) / HUGE_PAGE_SIZE) + 1) * HUGE_PAGE_SIZE;
-}
-
-#ifdef STACKS_FROM_HUGEPAGE
-static char* allocate_stacks_from_hugepages() {
-	char *p = static_cast<char *>(mmap(nullptr, round_to_huge_page_size(NUM_WORKER_THREADS * NUM_WORKER_COROS * STACK_SIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB , -1, 0));
-	if (p == MAP_FAILED) {
-      throw std::bad_alloc();
-      abort();
-    }
-    return p;
-}
-
-static void deallocate_stacks(char* stacks) {
-	munmap(stacks, round_to_huge_page_size(NUM_WORKER_THREADS * NUM_WORKER_COROS * STACK_SIZE));
-}
-#endif
-
 #ifdef RECORD_NUM_PRE
 static void signal_callback_handler(int signum) {
    uint64_t total_num_pre = 0;
-   for(int wid = 0; wid < NUM_WORKER_THREADS; wid++) {
+   for(int wid = 0; wid < num_worker_threads; wid++) {
         total_num_pre += num_pres[wid].size;
    }
-   std::cout << "Number of preemptions per core: " << total_num_pre/NUM_WORKER_THREADS << std::endl;
+   std::cout << "Number of preemptions per core: " << total_num_pre/num_worker_threads << std::endl;
    // Terminate program
    std::exit(signum);
 }
 #endif
 
 /*
- * Run an echo server
+ * Dispatch policies, picked at startup by --dispatch. A policy is built with
+ * Policy(workers, num_workers) over one pool of a dispatcher; pick() takes a
+ * worker out for dispatching and put_back() returns it once its load is
+ * updated; refresh() is called after the check-in updated all the workers of
+ * the dispatcher. They all decide on the same fields of worker_info_t, so
+ * they can be swapped under the same traffic, see live_dispatch.
  */
-static int run_server()
+
+/* join the shortest queue, optionally breaking ties by serviced quanta */
+template <bool Msq>
+struct jsq_dispatch {
+	// a min heap of worker info ptr
+	std::vector<worker_info_t*> worker_queue;
+
+	jsq_dispatch(worker_info_t* workers, int num_workers) {
+		for(int i = 0; i < num_workers; i++)
+			worker_queue.push_back(&workers[i]);
+		refresh();
+	}
+	worker_info_t* pick() {
+		std::pop_heap(worker_queue.begin(), worker_queue.end(), worker_info_ptr_cmp<Msq>);
+		worker_info_t* w = worker_queue.back();
+		worker_queue.pop_back();
+		return w;
+	}
+	void put_back(worker_info_t* w) {
+		worker_queue.push_back(w);
+		std::push_heap(worker_queue.begin(), worker_queue.end(), worker_info_ptr_cmp<Msq>);
+	}
+	void refresh() {
+		std::make_heap(worker_queue.begin(), worker_queue.end(), worker_info_ptr_cmp<Msq>);
+	}
+};
+
+/*
+ * The same, with the keys of the workers in a flat array that pick() scans
+ * with a SIMD argmin (load_report.h). The Msq key is load_msq_key(), which
+ * breaks ties on the backlog the same way as worker_info_ptr_cmp<true>.
+ */
+template <bool Msq>
+struct scan_dispatch {
+	worker_info_t* workers;
+	int num_workers;
+	// padded with LOAD_KEY_MAX
+	std::vector<int32_t> keys;
+
+	scan_dispatch(worker_info_t* workers, int num_workers) : workers(workers), num_workers(num_workers),
+		keys(load_scan_size(num_workers), LOAD_KEY_MAX) {
+		refresh();
+	}
+	static int32_t key(const worker_info_t* w) {
+		if(!Msq)
+			return worker_backlog(w);
+		return load_msq_key(worker_backlog(w), w->serviced_quanta);
+	}
+	worker_info_t* pick() { return &workers[load_argmin(keys.data(), keys.size())]; }
+	void put_back(worker_info_t* w) { keys[w - workers] = key(w); }
+	void refresh() {
+		for(int i = 0; i < num_workers; i++)
+			keys[i] = key(&workers[i]);
+	}
+};
+
+/*
+ * A worker drawn uniformly, with a xorshift generator of its own rather than
+ * std::rand(), which takes a lock, and a multiply-shift rather than a modulo
+ */
+struct rand_dispatch {
+	worker_info_t* workers;
+	int num_workers;
+	uint32_t seed;
+
+	rand_dispatch(worker_info_t* workers, int num_workers) : workers(workers), num_workers(num_workers),
+		seed(num_workers > 0? workers[0].wid + 1 : 1) {}
+	worker_info_t* pick() { return &workers[((uint64_t)xorshift32(&seed) * num_workers) >> 32]; }
+	void put_back(worker_info_t* w) {}
+	void refresh() {}
+};
+
+/* the least loaded of dispatch_d random workers */
+struct jsq_d_dispatch : rand_dispatch {
+	int d;
+
+	jsq_d_dispatch(worker_info_t* workers, int num_workers) : rand_dispatch(workers, num_workers), d(dispatch_d) {}
+	worker_info_t* pick() {
+		worker_info_t* best = rand_dispatch::pick();
+		for(int i = 1; i < d; i++) {
+			worker_info_t* w = rand_dispatch::pick();
+			if(worker_backlog(w) < worker_backlog(best))
+				best = w;
+		}
+		return best;
+	}
+};
+
+/*
+ * Join-idle-queue: the workers that had an idle coroutine at the last
+ * check-in wait in a FIFO and each pick takes the one at its head. A worker
+ * that still has one after the dispatch queues up again at the tail, so a
+ * worker is in the FIFO at most once. Picks are random while it is empty.
+ */
+struct jiq_dispatch : rand_dispatch {
+	// a ring of num_workers slots
+	std::vector<worker_info_t*> idle;
+	int head, count;
+
+	jiq_dispatch(worker_info_t* workers, int num_workers) : rand_dispatch(workers, num_workers), idle(num_workers) {
+		refresh();
+	}
+	worker_info_t* pick() {
+		if(count == 0)
+			return rand_dispatch::pick();
+		worker_info_t* w = idle[head];
+		if(++head == num_workers)
+			head = 0;
+		count--;
+		return w;
+	}
+	void put_back(worker_info_t* w) {
+		if(worker_backlog(w) >= 0)
+			return;
+		int tail = head + count;
+		idle[tail < num_workers? tail : tail - num_workers] = w;
+		count++;
+	}
+	void refresh() {
+		head = count = 0;
+		for(int i = 0; i < num_workers; i++) {
+			if(worker_backlog(&workers[i]) < 0)
+				idle[count++] = &workers[i];
+		}
+	}
+};
+
+/*
+ * All the policies side by side over the same workers, for comparing them
+ * under the same traffic: SIGUSR1 moves live_dispatch_policy on and each
+ * pool switches over at its next check-in, refreshing the policy taking over.
+ */
+struct live_dispatch {
+	int cur;
+	scan_dispatch<false> jsq;
+	scan_dispatch<true> msq;
+	rand_dispatch rnd;
+	jsq_d_dispatch jsq_d;
+	jsq_dispatch<false> jsq_heap;
+	jsq_dispatch<true> msq_heap;
+	jiq_dispatch jiq;
+
+	live_dispatch(worker_info_t* workers, int num_workers) : cur(live_dispatch_policy),
+		jsq(workers, num_workers), msq(workers, num_workers), rnd(workers, num_workers), jsq_d(workers, num_workers),
+		jsq_heap(workers, num_workers), msq_heap(workers, num_workers), jiq(workers, num_workers) {}
+	worker_info_t* pick() {
+		switch(cur) {
+		case DISPATCH_JSQ:
+			return jsq.pick();
+		case DISPATCH_RAND:
+			return rnd.pick();
+		case DISPATCH_JSQ_D:
+			return jsq_d.pick();
+		case DISPATCH_JSQ_HEAP:
+			return jsq_heap.pick();
+		case DISPATCH_MSQ_HEAP:
+			return msq_heap.pick();
+		case DISPATCH_JIQ:
+			return jiq.pick();
+		default:
+			return msq.pick();
+		}
+	}
+	void put_back(worker_info_t* w) {
+		switch(cur) {
+		case DISPATCH_JSQ:
+			return jsq.put_back(w);
+		case DISPATCH_RAND:
+			return rnd.put_back(w);
+		case DISPATCH_JSQ_D:
+			return jsq_d.put_back(w);
+		case DISPATCH_JSQ_HEAP:
+			return jsq_heap.put_back(w);
+		case DISPATCH_MSQ_HEAP:
+			return msq_heap.put_back(w);
+		case DISPATCH_JIQ:
+			return jiq.put_back(w);
+		default:
+			return msq.put_back(w);
+		}
+	}
+	void refresh() {
+		cur = __atomic_load_n(&live_dispatch_policy, __ATOMIC_RELAXED);
+		switch(cur) {
+		case DISPATCH_JSQ:
+			return jsq.refresh();
+		case DISPATCH_RAND:
+			return rnd.refresh();
+		case DISPATCH_JSQ_D:
+			return jsq_d.refresh();
+		case DISPATCH_JSQ_HEAP:
+			return jsq_heap.refresh();
+		case DISPATCH_MSQ_HEAP:
+			return msq_heap.refresh();
+		case DISPATCH_JIQ:
+			return jiq.refresh();
+		default:
+			return msq.refresh();
+		}
+	}
+};
+
+/* SIGUSR1 with --dispatch-live */
+static void next_dispatch_policy(int signum)
 {
-	pin_to_cpu(0);
+	int policy = (live_dispatch_policy + 1) % NUM_DISPATCH_POLICIES;
+	char msg[64] = "dispatching with ";
+	size_t len = strlen(msg);
+	ssize_t ret;
+
+	__atomic_store_n(&live_dispatch_policy, policy, __ATOMIC_RELAXED);
+	// no stdio in a signal handler
+	for(const char* c = dispatch_policy_names[policy]; *c; c++)
+		msg[len++] = *c;
+	msg[len++] = '\n';
+	ret = write(STDOUT_FILENO, msg, len);
+	(void)ret;
+}
 
-	printf("lcore %u running in server mode. [Ctrl+C to quit]\n", rte_lcore_id());
+/*
+ * Whether a request goes to the long worker pool, by its req_type
+ */
+static inline bool is_long_request(const struct rte_mbuf *rx_mbuf)
+{
+	uint32_t req_type;
 
-	pthread_t worker_threads[NUM_WORKER_THREADS];
-	// input arguments to worker pthreads
-	worker_arg_t worker_args[NUM_WORKER_THREADS];
-	// worker information
-	std::vector<worker_info_t> worker_info_vec;
+	// malformed packets are left to the short pool to drop
+	if (unlikely(rte_pktmbuf_data_len(rx_mbuf) < RESPONSE_HDR_LEN))
+		return false;
+	req_type = rte_be_to_cpu_32(rte_pktmbuf_mtod_offset(rx_mbuf, const struct rte_rocksdb_hdr *, ROCKSDB_HDR_OFFSET)->req_type);
+	return req_type < 64 && (long_req_types >> req_type) & 1;
+}
 
-	/* initialize worker info */
-	for(int wid = 0; wid < NUM_WORKER_THREADS; wid++) {
-		worker_info_vec.emplace_back(wid);
+/*
+ * Dispatch packets of one RX queue to the workers owned by this dispatcher
+ */
+template <class Policy, bool Rebalance, bool Steer>
+void* dispatcher(void* arg)
+{
+	dispatcher_arg_t* dispatcher_arg = static_cast<dispatcher_arg_t*>(arg);
+	int did = dispatcher_arg->did;
+	int first_wid = dispatcher_arg->first_wid;
+	int num_workers = dispatcher_arg->num_workers;
+	int num_long_workers = Steer? dispatcher_arg->num_long_workers : 0;
+	int num_short_workers = num_workers - num_long_workers;
+	worker_info_t* workers = dispatcher_arg->workers;
+	uint16_t rx_queue = dispatcher_arg->rx_queue;
+
+	if(did != 0) {
+		rte_thread_register();
+		pin_to_cpu(did);
 	}
-	/* dispatch queues */
-	for(int wid = 0; wid < NUM_WORKER_THREADS; wid++) {
-		char name[32];
-		snprintf(name, sizeof(name), "dispatch_ring_%d", wid);
-		worker_info_vec[wid].rx_mbuf_dispatch_q = rte_ring_create(name, DISPATCH_RING_SIZE, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
-    }
-    #ifndef NEW_DISPATCHER
-    /* return queues */
-	for(int wid = 0; wid < NUM_WORKER_THREADS; wid++) {
-		char name[32];
-		snprintf(name, sizeof(name), "return_ring_%d", wid);
-		worker_info_vec[wid].rx_mbuf_return_q = rte_ring_create(name, RETURN_RING_SIZE, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
-    }
-    #else
-    /* thread-local prev sizes of workers */
-    uint64_t prev_sizes[NUM_WORKER_THREADS] = {0};
-    /* allocate space for curr sizes of workers */
-    assert(sizeof(struct cache_filled_size) == CACHE_LINE_SIZE);
-    curr_sizes =  static_cast<struct cache_filled_size *>(rte_malloc(nullptr, NUM_WORKER_THREADS * sizeof(struct cache_filled_size), CACHE_LINE_SIZE)); 
-    for(int wid = 0; wid < NUM_WORKER_THREADS; wid++) {
-	    curr_sizes[wid].size = 0;
-    }
-    #endif
+	printf("lcore %u running dispatcher %d on RX queue %u with workers %d-%d\n", rte_lcore_id(), did, rx_queue, first_wid, first_wid + num_workers - 1);
+	if(Steer)
+		printf("dispatcher %d: long requests go to workers %d-%d\n", did, first_wid + num_short_workers, first_wid + num_workers - 1);
 
-    #ifdef RECORD_NUM_PRE
-    for(int wid = 0; wid < NUM_WORKER_THREADS; wid++) {
-            num_pres[wid].size = 0;
-    }
-    // Register signal and signal handler
-    std::signal(SIGINT, signal_callback_handler);
-    #endif
-	/* worker threads */
-    for(int wid = 0; wid < NUM_WORKER_THREADS; wid++) {
-        worker_args[wid].wid = wid;
-        #ifdef STACKS_FROM_HUGEPAGE
-        worker_args[wid].stack_pool = stacks; 
-        stacks += NUM_WORKER_COROS * STACK_SIZE; 
-        #endif
-        worker_args[wid].rx_mbuf_dispatch_q = worker_info_vec[wid].rx_mbuf_dispatch_q;
-	#ifndef NEW_DISPATCHER
-	worker_args[wid].rx_mbuf_return_q = worker_info_vec[wid].rx_mbuf_return_q;
+	#ifdef NEW_DISPATCHER
+	/* thread-local prev sizes of workers */
+	std::vector<uint32_t> prev_sizes(num_workers, 0);
 	#endif
-	pthread_create(&worker_threads[wid], nullptr, *worker, static_cast<void*>(&worker_args[wid]));
-        worker_info_vec[wid].work_thread = &worker_threads[wid];
-	}
 
-	// a min heap of worker info ptr 
-	std::priority_queue<worker_info*, std::vector<worker_info*>, decltype(&worker_info_ptr_cmp)> worker_queue(worker_info_ptr_cmp);
-	for(int wid = 0; wid < NUM_WORKER_THREADS; wid++)
-		worker_queue.push(&worker_info_vec[wid]);
+	Policy worker_queue(workers, num_short_workers);
+	// empty unless steering
+	Policy long_worker_queue(workers + num_short_workers, num_long_workers);
 
 	uint8_t port = dpdk_port;
-	struct rte_mbuf *rx_bufs[RX_QUEUE_BURST_SIZE];
-	uint16_t nb_rx, i, nb_return, total_return_size, return_size;
+	std::vector<struct rte_mbuf*> rx_buf_vec(rx_queue_burst_size);
+	struct rte_mbuf **rx_bufs = rx_buf_vec.data();
+	std::vector<struct rte_mbuf*> long_buf_vec(Steer? rx_queue_burst_size : 0);
+	struct rte_mbuf **long_bufs = long_buf_vec.data();
+	uint16_t nb_rx, nb_short, nb_long, i, nb_return, total_return_size, return_size;
 	uint16_t return_queue_checkin_idx = 0;
 	worker_info_t* tmp_w;
 	int cur_version_number = 0;
 	//int num_received_jobs = 0;
 	int total_running_jobs = 0, packet_drop_count = 0;
+	struct load_report report;
 	#ifdef NEW_DISPATCHER
 	uint32_t dispatch_size, max_dispatch_size;
-	uint64_t curr_size;
 	#else
-	struct rte_mbuf *return_rx_bufs[FREE_MBUF_MAX_BATCH_SIZE];
+	std::vector<struct rte_mbuf*> return_rx_buf_vec(FREE_MBUF_MAX_BATCH_SIZE);
+	struct rte_mbuf **return_rx_bufs = return_rx_buf_vec.data();
 	#endif
 
-	#ifdef SERVER_LAT
-	uint32_t start_tsc;
-	#endif
-
-	/* Run until the application is quit or killed. */
-	for (;;) {
-		/* if there were packets buffered, handle them first before starting to receive again */
-		/* receive packets */
-		nb_rx = rte_eth_rx_burst(port, 0, rx_bufs, RX_QUEUE_BURST_SIZE);
-			
-		if (nb_rx == 0)
-			continue;
+	struct rte_ring *handoff_q = Rebalance? handoff_qs[did] : nullptr;
+	struct dispatcher_telemetry *tm = &dispatcher_tm[did];
+	// peer to hand part of each burst off to, -1 if balanced
+	int rebalance_target = -1;
+	uint16_t nb_handoff;
+	uint64_t my_load, min_load;
+
+	/* overloaded responses go out on a TX queue of our own */
+	uint16_t tx_queue = num_worker_threads + did;
+	uint64_t reject_count = 0;
+	auto reject = [&](struct rte_mbuf **bufs, uint16_t nb) {
+		reject_requests(tx_queue, bufs, nb);
+		telemetry_add(&tm->rejects, nb);
+		reject_count += nb;
+		if(reject_count >= 100000) {
+			std::cout << "100K requests rejected!" << std::endl;
+			reject_count = 0;
+		}
+	};
 
-		#ifdef SERVER_LAT
-		start_tsc = rdtsc();
-		for(i = 0; i < nb_rx; i ++) {
-			static_cast< struct rte_pktmbuf_pool_private_with_start_tsc* >(rte_mbuf_to_priv(rx_bufs[i]))->start_tsc = start_tsc;
+	/* take in what a worker reported since it was last read, its returned RX mbufs go to bufs */
+	auto read_report = [&](worker_info_t* w, struct rte_mbuf **bufs) -> uint16_t {
+		uint16_t n = 0;
+		load_report_read(&load_reports[w->wid], &report);
+		#ifdef NEW_DISPATCHER
+		n = report.completed - prev_sizes[w->wid - first_wid];
+		prev_sizes[w->wid - first_wid] = report.completed;
+		#else
+		for(uint16_t nb;;) {
+			// drain the return queue
+			nb = rte_ring_dequeue_burst(w->rx_mbuf_return_q, (void **)&bufs[n], RETURN_RING_BURST_SIZE, nullptr);
+			n += nb;
+			if(nb == 0)
+				break;
 		}
 		#endif
-
+		w->num_running_jobs -= n;
+		w->serviced_quanta = report.sq;
+		w->num_coros = report.coros;
+		return n;
+	};
+
+	/* read one worker again between check-ins */
+	auto reread_worker = [&](worker_info_t* w) {
 		#ifdef NEW_DISPATCHER
-		// efficient way of computing ceil(nb_rx/NUM_WORKER_THREADS)
-		max_dispatch_size = (nb_rx + NUM_WORKER_THREADS - 1) / NUM_WORKER_THREADS;
-		for(i = 0; i < nb_rx; i += max_dispatch_size) {
-			#ifdef RAND_DISP
-			#ifdef POWER_TWO
-			worker_info_t* w1 = &worker_info_vec[std::rand() % NUM_WORKER_THREADS];
-		        worker_info_t* w2 = &worker_info_vec[std::rand() % NUM_WORKER_THREADS];
-			tmp_w = (w1->num_running_jobs < w2->num_running_jobs)? w1 : w2; 	
-			#else
-			tmp_w = &worker_info_vec[std::rand() % NUM_WORKER_THREADS];
-			#endif
-			#else
-			tmp_w = worker_queue.top();
-                        worker_queue.pop();
-			#endif
-			dispatch_size = (i + max_dispatch_size < nb_rx)? max_dispatch_size : nb_rx - i; 
-			nb_return = rte_ring_enqueue_burst(tmp_w->rx_mbuf_dispatch_q, (void **)&rx_bufs[i], dispatch_size, nullptr);
-			
+		return_size = read_report(w, nullptr);
+		#else
+		return_size = read_report(w, return_rx_bufs);
+		rte_pktmbuf_free_bulk(return_rx_bufs, return_size);
+		#endif
+		total_running_jobs -= return_size;
+	};
+
+	/*
+	 * Take a worker into tmp_w, false if it is overloaded. The counts are as
+	 * old as the last check-in, and none comes while every worker looks
+	 * overloaded, since none gets packets. So the worker is read again before
+	 * rejecting for it and, if it still is overloaded, the whole pool once a
+	 * burst.
+	 */
+	auto pick_admitted = [&](Policy& pool, worker_info_t* pool_workers, int pool_size, bool& reread) {
+		tmp_w = pool.pick();
+		if(likely(!worker_overloaded(tmp_w)))
+			return true;
+		reread_worker(tmp_w);
+		if(!worker_overloaded(tmp_w) || reread)
+			return !worker_overloaded(tmp_w);
+		reread = true;
+		pool.put_back(tmp_w);
+		for(int j = 0; j < pool_size; j++)
+			reread_worker(&pool_workers[j]);
+		pool.refresh();
+		tmp_w = pool.pick();
+		return !worker_overloaded(tmp_w);
+	};
+
+	/* spread nb packets over the workers of one pool */
+	auto dispatch_burst = [&](Policy& pool, worker_info_t* pool_workers, int pool_size, struct rte_mbuf **bufs, uint16_t nb) {
+		uint16_t i;
+		bool reread = false;
+		if(nb == 0)
+			return;
+		#ifdef NEW_DISPATCHER
+		// efficient way of computing ceil(nb/pool_size)
+		max_dispatch_size = (nb + pool_size - 1) / pool_size;
+		for(i = 0; i < nb; i += max_dispatch_size) {
+			dispatch_size = (i + max_dispatch_size < nb)? max_dispatch_size : nb - i; 
+			if(unlikely(!pick_admitted(pool, pool_workers, pool_size, reread))) {
+				reject(&bufs[i], dispatch_size);
+				pool.put_back(tmp_w);
+				continue;
+			}
+			nb_return = rte_ring_enqueue_burst(tmp_w->rx_mbuf_dispatch_q, (void **)&bufs[i], dispatch_size, nullptr);
+		
 			if(unlikely(nb_return != dispatch_size)) {
 				// drop all the packets onwards 
                                 // dispatcher may have stale information about the number of jobs each worker has, hence force a return pull
-				rte_pktmbuf_free_bulk(&rx_bufs[i + nb_return], dispatch_size - nb_return);
+				rte_pktmbuf_free_bulk(&bufs[i + nb_return], dispatch_size - nb_return);
+				telemetry_add(&tm->drops, dispatch_size - nb_return);
+				telemetry_add(&tm->dispatched, nb_return);
 				total_running_jobs += nb_return;
 				tmp_w->num_running_jobs += nb_return;
-				#ifndef RAND_DISP
-				worker_queue.push(tmp_w);
-				#endif
+				pool.put_back(tmp_w);
 				//std::cout << "Packet drop: total number of running jobs " << total_running_jobs << std::endl;
 				packet_drop_count++;
 				if(packet_drop_count == 100000) {
@@ -1063,61 +2239,97 @@ static int run_server()
 				continue;	
 			}
 			tmp_w->num_running_jobs += nb_return;
-			#ifndef RAND_DISP
-                        worker_queue.push(tmp_w);
-			#endif
+			pool.put_back(tmp_w);
+			telemetry_add(&tm->dispatched, nb_return);
                         return_queue_checkin_idx += nb_return;
                         total_running_jobs += nb_return;
 		}		
 		#else
-		for(i = 0; i < nb_rx; i++) {
-			tmp_w = worker_queue.top();
-			worker_queue.pop();
-			if(unlikely(rte_ring_enqueue(tmp_w->rx_mbuf_dispatch_q, rx_bufs[i]) < 0)) {
+		for(i = 0; i < nb; i++) {
+			if(unlikely(!pick_admitted(pool, pool_workers, pool_size, reread))) {
+				reject(&bufs[i], 1);
+				pool.put_back(tmp_w);
+				continue;
+			}
+			if(unlikely(rte_ring_enqueue(tmp_w->rx_mbuf_dispatch_q, bufs[i]) < 0)) {
 				// drop this packet
 				// dispatcher may have stale information about the number of jobs each worker has, hence force a return pull
-				rte_pktmbuf_free(rx_bufs[i]);
-				worker_queue.push(tmp_w);
+				rte_pktmbuf_free(bufs[i]);
+				pool.put_back(tmp_w);
+				telemetry_add(&tm->drops, 1);
 				std::cout << "Packet drop: total number of running jobs " << total_running_jobs << std::endl;
 				continue;
 			} 
 			tmp_w->num_running_jobs++;
-			worker_queue.push(tmp_w); 
+			pool.put_back(tmp_w); 
+			telemetry_add(&tm->dispatched, 1);
 			return_queue_checkin_idx++;
 			total_running_jobs++;
 		}
 		#endif
+	};
+
+	/* Run until the application is quit or killed. */
+	for (;;) {
+		/* if there were packets buffered, handle them first before starting to receive again */
+		/* receive packets */
+		nb_rx = rte_eth_rx_burst(port, rx_queue, rx_bufs, rx_queue_burst_size);
+			
+		if (!Rebalance && nb_rx == 0)
+			continue;
+		telemetry_add(&tm->rx_pkts, nb_rx);
+
+		if(stamp_arrivals)
+			stamp_arrival(rx_bufs, nb_rx);
+
+		if(Rebalance) {
+			if(rebalance_target >= 0 && nb_rx > 1) {
+				// hand the tail of the burst off; whatever the peer can't take stays here
+				nb_handoff = nb_rx >> REBALANCE_SHIFT;
+				nb_handoff = rte_ring_enqueue_burst(handoff_qs[rebalance_target], (void **)&rx_bufs[nb_rx - nb_handoff], nb_handoff, nullptr);
+				nb_rx -= nb_handoff;
+				telemetry_add(&tm->handoffs, nb_handoff);
+			}
+			// packets handed off by peers are never forwarded again
+			nb_rx += rte_ring_dequeue_burst(handoff_q, (void **)&rx_bufs[nb_rx], rx_queue_burst_size - nb_rx, nullptr);
+
+			if (nb_rx == 0)
+				continue;
+		}
+
+		if(Steer) {
+			// split the burst by request class, keeping the order within each
+			nb_short = nb_long = 0;
+			for(i = 0; i < nb_rx; i++) {
+				if(i + PREFETCH_OFFSET < nb_rx)
+					rte_prefetch0(rte_pktmbuf_mtod_offset(rx_bufs[i + PREFETCH_OFFSET], void *, ROCKSDB_HDR_OFFSET));
+				if(is_long_request(rx_bufs[i]))
+					long_bufs[nb_long++] = rx_bufs[i];
+				else
+					rx_bufs[nb_short++] = rx_bufs[i];
+			}
+			dispatch_burst(worker_queue, workers, num_short_workers, rx_bufs, nb_short);
+			dispatch_burst(long_worker_queue, workers + num_short_workers, num_long_workers, long_bufs, nb_long);
+		} else {
+			dispatch_burst(worker_queue, workers, num_workers, rx_bufs, nb_rx);
+		}
 
 		// check in
 		if(return_queue_checkin_idx >= RETURN_RING_CHECKIN_PERIOD) {
 			total_return_size = 0;
-			for(i = 0; i < NUM_WORKER_THREADS; i++) {
-				tmp_w = worker_queue.top();
-				worker_queue.pop();
+			for(i = 0; i < num_workers; i++) {
+				tmp_w = &workers[i];
 				assert(tmp_w->version_number == cur_version_number);
 				#ifdef NEW_DISPATCHER
-				curr_size = curr_sizes[tmp_w->wid].size;
-				return_size = curr_size - prev_sizes[tmp_w->wid];
-				prev_sizes[tmp_w->wid] = curr_size;
-				total_return_size += return_size;
-				#ifdef MSQ
-                                tmp_w->serviced_quanta = curr_sizes[tmp_w->wid].sq;
-                                #endif
+				total_return_size += read_report(tmp_w, nullptr);
 				#else
-				return_size = 0;
-				for(;;) {
-					// drain the return queue
-					nb_return = rte_ring_dequeue_burst(tmp_w->rx_mbuf_return_q, (void **)&return_rx_bufs[total_return_size], RETURN_RING_BURST_SIZE, nullptr);
-					total_return_size += nb_return;
-					return_size += nb_return;
-					if(nb_return == 0)
-						break;
-				}
+				total_return_size += read_report(tmp_w, &return_rx_bufs[total_return_size]);
 				#endif
-				tmp_w->num_running_jobs -= return_size;
 				tmp_w->version_number ++;
-				worker_queue.push(tmp_w);
 			}
+			worker_queue.refresh();
+			if(Steer)
+				long_worker_queue.refresh();
 			#ifndef NEW_DISPATCHER
 			// free them in a large bulk
 			rte_pktmbuf_free_bulk(return_rx_bufs, total_return_size);
@@ -1125,9 +2337,194 @@ static int run_server()
 			return_queue_checkin_idx = 0;
 			cur_version_number++;
 			total_running_jobs -= total_return_size;
+
+			if(Rebalance) {
+				// publish our load and pick the least loaded peer if it is far enough below us
+				my_load = ((uint64_t)total_running_jobs << 10) / num_workers;
+				dispatcher_loads[did].load = my_load;
+				rebalance_target = -1;
+				min_load = my_load;
+				for(int d = 0; d < num_dispatchers; d++) {
+					if(dispatcher_loads[d].load < min_load) {
+						min_load = dispatcher_loads[d].load;
+						rebalance_target = d;
+					}
+				}
+				if(rebalance_target >= 0 && my_load - min_load < ((uint64_t)REBALANCE_THRESHOLD << 10))
+					rebalance_target = -1;
+			}
 		}
 	}
 
+	return nullptr;
+}
+
+typedef void* (*thread_fn_t)(void*);
+
+template <class Sched>
+static thread_fn_t select_worker_fn()
+{
+	return work_stealing? worker<Sched, true> : worker<Sched, false>;
+}
+
+/* instantiate the worker loop for the configured policies */
+static thread_fn_t select_worker()
+{
+	switch(sched_policy) {
+	case SCHED_FCFS:
+		return select_worker_fn<fcfs_sched>();
+	case SCHED_LAS:
+		return select_worker_fn<las_sched>();
+	case SCHED_MLFQ:
+		return select_worker_fn<mlfq_sched>();
+	case SCHED_EDF:
+		return select_worker_fn<edf_sched>();
+	default:
+		return select_worker_fn<ps_sched>();
+	}
+}
+
+template <class Policy, bool Rebalance>
+static thread_fn_t select_dispatcher_fn()
+{
+	return num_long_workers > 0? dispatcher<Policy, Rebalance, true> : dispatcher<Policy, Rebalance, false>;
+}
+
+template <class Policy>
+static thread_fn_t select_dispatcher_fn()
+{
+	return dispatcher_rebalance? select_dispatcher_fn<Policy, true>() : select_dispatcher_fn<Policy, false>();
+}
+
+/* instantiate the dispatcher loop for the configured policies */
+static thread_fn_t select_dispatcher()
+{
+	if(dispatch_live)
+		return select_dispatcher_fn<live_dispatch>();
+	switch(dispatch_policy) {
+	case DISPATCH_JSQ:
+		return select_dispatcher_fn<scan_dispatch<false> >();
+	case DISPATCH_RAND:
+		return select_dispatcher_fn<rand_dispatch>();
+	case DISPATCH_JSQ_D:
+		return select_dispatcher_fn<jsq_d_dispatch>();
+	case DISPATCH_JSQ_HEAP:
+		return select_dispatcher_fn<jsq_dispatch<false> >();
+	case DISPATCH_MSQ_HEAP:
+		return select_dispatcher_fn<jsq_dispatch<true> >();
+	case DISPATCH_JIQ:
+		return select_dispatcher_fn<jiq_dispatch>();
+	default:
+		return select_dispatcher_fn<scan_dispatch<true> >();
+	}
+}
+
+/*
+ * Run an echo server
+ */
+static int run_server()
+{
+	pin_to_cpu(0);
+
+	printf("lcore %u running in server mode. [Ctrl+C to quit]\n", rte_lcore_id());
+
+	thread_fn_t worker_fn = select_worker();
+	thread_fn_t dispatcher_fn = select_dispatcher();
+	std::vector<pthread_t> worker_threads(num_worker_threads);
+	// input arguments to worker pthreads
+	std::vector<worker_arg_t> worker_args(num_worker_threads);
+	std::vector<pthread_t> dispatcher_threads(num_dispatchers);
+	// input arguments to dispatchers
+	std::vector<dispatcher_arg_t> dispatcher_args(num_dispatchers);
+	// worker information
+	std::vector<worker_info_t> worker_info_vec;
+
+	/* initialize worker info */
+	for(int wid = 0; wid < num_worker_threads; wid++) {
+		worker_info_vec.emplace_back(wid);
+	}
+	/* dispatch queues */
+	ws_dispatch_qs = static_cast<struct rte_ring **>(rte_zmalloc(nullptr, num_worker_threads * sizeof(struct rte_ring *), 0));
+	for(int wid = 0; wid < num_worker_threads; wid++) {
+		char name[32];
+		snprintf(name, sizeof(name), "dispatch_ring_%d", wid);
+		if(work_stealing) {
+			// thieves dequeue concurrently with the owner
+			worker_info_vec[wid].rx_mbuf_dispatch_q = rte_ring_create(name, dispatch_ring_size, rte_socket_id(), RING_F_SP_ENQ);
+			ws_dispatch_qs[wid] = worker_info_vec[wid].rx_mbuf_dispatch_q;
+		} else {
+			worker_info_vec[wid].rx_mbuf_dispatch_q = rte_ring_create(name, dispatch_ring_size, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+		}
+		if(worker_info_vec[wid].rx_mbuf_dispatch_q == nullptr)
+			rte_exit(EXIT_FAILURE, "Cannot create %s\n", name);
+    }
+    if(steal_nic_queue)
+	    rx_queue_locks = static_cast<struct cache_filled_lock *>(rte_zmalloc(nullptr, num_worker_threads * sizeof(struct cache_filled_lock), CACHE_LINE_SIZE));
+    #ifndef NEW_DISPATCHER
+    /* return queues */
+	for(int wid = 0; wid < num_worker_threads; wid++) {
+		char name[32];
+		snprintf(name, sizeof(name), "return_ring_%d", wid);
+		worker_info_vec[wid].rx_mbuf_return_q = rte_ring_create(name, RETURN_RING_SIZE, rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ);
+    }
+    #endif
+    /* allocate space for the load reports of workers */
+    load_reports = static_cast<struct load_report *>(rte_zmalloc(nullptr, num_worker_threads * sizeof(struct load_report), CACHE_LINE_SIZE));
+
+    if(dispatcher_rebalance) {
+	    dispatcher_loads = static_cast<struct cache_filled_load *>(rte_zmalloc(nullptr, num_dispatchers * sizeof(struct cache_filled_load), CACHE_LINE_SIZE));
+	    handoff_qs = static_cast<struct rte_ring **>(rte_zmalloc(nullptr, num_dispatchers * sizeof(struct rte_ring *), 0));
+	    /* handoff queues, any peer may enqueue */
+	    for(int did = 0; did < num_dispatchers; did++) {
+		    char name[32];
+		    snprintf(name, sizeof(name), "handoff_ring_%d", did);
+		    handoff_qs[did] = rte_ring_create(name, HANDOFF_RING_SIZE, rte_socket_id(), RING_F_SC_DEQ);
+	    }
+    }
+
+    #ifdef RECORD_NUM_PRE
+    assert(sizeof(struct cache_filled_size) == CACHE_LINE_SIZE);
+    num_pres = static_cast<struct cache_filled_size *>(rte_zmalloc(nullptr, num_worker_threads * sizeof(struct cache_filled_size), CACHE_LINE_SIZE));
+    // Register signal and signal handler
+    std::signal(SIGINT, signal_callback_handler);
+    #endif
+    if(dispatch_live) {
+	    live_dispatch_policy = dispatch_policy;
+	    std::signal(SIGUSR1, next_dispatch_policy);
+    }
+	/* worker threads */
+    for(int wid = 0; wid < num_worker_threads; wid++) {
+        worker_args[wid].wid = wid;
+        worker_args[wid].rx_mbuf_dispatch_q = worker_info_vec[wid].rx_mbuf_dispatch_q;
+	#ifndef NEW_DISPATCHER
+	worker_args[wid].rx_mbuf_return_q = worker_info_vec[wid].rx_mbuf_return_q;
+	#endif
+	pthread_create(&worker_threads[wid], nullptr, worker_fn, static_cast<void*>(&worker_args[wid]));
+        worker_info_vec[wid].work_thread = &worker_threads[wid];
+	}
+
+	if(work_stealing) {
+		// workers poll the NIC themselves, nothing left to do here
+		for(int wid = 0; wid < num_worker_threads; wid++)
+			pthread_join(worker_threads[wid], nullptr);
+		return 0;
+	}
+
+	/* dispatchers, each owning a contiguous range of workers */
+	for(int did = 0; did < num_dispatchers; did++) {
+		dispatcher_args[did].did = did;
+		dispatcher_args[did].rx_queue = did;
+		dispatcher_args[did].first_wid = did * num_worker_threads / num_dispatchers;
+		dispatcher_args[did].num_workers = (did + 1) * num_worker_threads / num_dispatchers - dispatcher_args[did].first_wid;
+		dispatcher_args[did].num_long_workers = (did + 1) * num_long_workers / num_dispatchers - did * num_long_workers / num_dispatchers;
+		dispatcher_args[did].workers = &worker_info_vec[dispatcher_args[did].first_wid];
+	}
+	for(int did = 1; did < num_dispatchers; did++) {
+		pthread_create(&dispatcher_threads[did], nullptr, dispatcher_fn, static_cast<void*>(&dispatcher_args[did]));
+	}
+	// the main thread serves as dispatcher 0
+	dispatcher_fn(static_cast<void*>(&dispatcher_args[0]));
+
 	return 0;
 }
 
@@ -1233,13 +2630,18 @@ rte_pktmbuf_pool_create_spsc(const char *name, unsigned int n,
 	size_t private_size = sizeof(struct rte_pktmbuf_pool_private);
 	#endif
 	
+	unsigned int flags;
+	if (num_dispatchers > 1 || work_stealing)
+		// every dispatcher (or worker) refills its own RX queue from this pool
+		flags = 0;
+	else
 	#ifdef NEW_DISPATCHER
-	mp = rte_mempool_create_empty(name, n, elt_size, cache_size,
-                 private_size, socket_id, RTE_MEMPOOL_F_SC_GET);
+		flags = RTE_MEMPOOL_F_SC_GET;
 	#else
-	mp = rte_mempool_create_empty(name, n, elt_size, cache_size,
-		 private_size, socket_id, RTE_MEMPOOL_F_SP_PUT | RTE_MEMPOOL_F_SC_GET);
+		flags = RTE_MEMPOOL_F_SP_PUT | RTE_MEMPOOL_F_SC_GET;
 	#endif
+	mp = rte_mempool_create_empty(name, n, elt_size, cache_size,
+		 private_size, socket_id, flags);
 	if (mp == NULL)
 		return NULL;
 
@@ -1281,50 +2683,608 @@ static int dpdk_init(int argc, char *argv[])
 	if (args_parsed < 0)
 		rte_exit(EXIT_FAILURE, "Error with EAL initialization\n");
 
-	/* Check that there is a port to send/receive on. */
-	if (!rte_eth_dev_is_valid_port(dpdk_port))
-		rte_exit(EXIT_FAILURE, "Error: port is not available\n");
+	return args_parsed;
+}
 
+/*
+ * Create the mbuf pools, once the settings are known.
+ */
+static void mbuf_pool_init()
+{
 	/* Creates a new mempool in memory to hold the mbufs. */
-	rx_mbuf_pool = rte_pktmbuf_pool_create_spsc("MBUF_RX_POOL", RX_MBUF_POOL_SIZE,
+	rx_mbuf_pool = rte_pktmbuf_pool_create_spsc("MBUF_RX_POOL", rx_mbuf_pool_size,
 		RX_MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 
 	if (rx_mbuf_pool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot create rx mbuf pool\n");
 
 	/* Creates a new mempool in memory to hold the mbufs. */
-	tx_mbuf_pool = rte_pktmbuf_pool_create_w_customized_init("MBUF_TX_POOL", TX_MBUF_POOL_SIZE,
+	tx_mbuf_pool = rte_pktmbuf_pool_create_w_customized_init("MBUF_TX_POOL", tx_mbuf_pool_size,
 		TX_MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 
 	if (tx_mbuf_pool == NULL)
 		rte_exit(EXIT_FAILURE, "Cannot create tx mbuf pool\n");
+}
 
-	return args_parsed;
+/*
+ * Map the telemetry segment. If it cannot be shared the counters are still
+ * kept, just not readable by tq_telemetry.
+ */
+static void telemetry_init()
+{
+	uint32_t nd = work_stealing? 0 : num_dispatchers;
+	uint64_t size = telemetry_size(num_worker_threads, nd);
+	void *p = MAP_FAILED;
+	int fd;
+
+	// a stale segment may be sized for another configuration
+	shm_unlink(telemetry_name);
+	fd = shm_open(telemetry_name, O_CREAT | O_RDWR, 0644);
+	if (fd >= 0) {
+		if (ftruncate(fd, size) == 0)
+			p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (p == MAP_FAILED) {
+		printf("warning: cannot export telemetry as %s: %s\n", telemetry_name, strerror(errno));
+		p = rte_zmalloc(nullptr, size, TELEMETRY_CACHE_LINE);
+		if (p == nullptr)
+			rte_exit(EXIT_FAILURE, "Cannot allocate telemetry\n");
+	} else {
+		printf("telemetry exported as %s\n", telemetry_name);
+	}
+
+	telemetry = static_cast<struct telemetry_hdr *>(p);
+	telemetry->num_workers = num_worker_threads;
+	telemetry->num_dispatchers = nd;
+	telemetry->num_job_types = TELEMETRY_NUM_JOB_TYPES;
+	telemetry->tsc_hz = rte_get_tsc_hz();
+	worker_tm = telemetry_workers(telemetry);
+	dispatcher_tm = telemetry_dispatchers(telemetry);
+	// readers wait for the magic before they trust the rest of the header
+	__atomic_store_n(&telemetry->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
 }
 
-static int parse_args(int argc, char *argv[])
+static void usage(const char *prgname)
+{
+	printf("usage: %s [EAL options] -- [options] <server ip>\n"
+	       "  --config FILE            read options from FILE, one \"key = value\" per line\n"
+	       "  --workers N              number of worker threads (%d)\n"
+	       "  --coros N                coroutines per worker (%d)\n"
+	       "  --max-coros N            grow backlogged workers up to N coroutines (--coros)\n"
+	       "  --coro-cooldown-us US    retire extra coroutines idle for US us (%d)\n"
+	       "  --stack-size N           bytes per coroutine stack, a multiple of 4096 (%d)\n"
+	       "  --dispatchers N          number of dispatchers, one RX queue each (%d)\n"
+	       "  --quantum-cycle N        quantum in cycles (%d)\n"
+	       "  --quantum-ic N           quantum in IR instructions (%d)\n"
+	       "  --dispatch-ring-size N   per-worker dispatch ring size, power of 2 (%d)\n"
+	       "  --tx-dequeue-period N    quanta between TX flushes (%d)\n"
+	       "  --sched ps|fcfs|las|mlfq|edf\n"
+	       "                           worker scheduling policy (ps)\n"
+	       "  --class T:Q:P[,...]      with --sched mlfq, req_type T runs Q-cycle quanta (0 to\n"
+	       "                           completion) starting at priority level P (0 highest)\n"
+	       "  --slo-us US              with --sched edf, deadline of requests without an SLO (%d)\n"
+	       "  --class-slo T:US[,...]   with --sched edf, deadline of req_type T without an SLO\n"
+	       "  --edf-shed               with --sched edf, answer jobs past their deadline as overloaded\n"
+	       "  --dispatch jsq|msq|rand|jsq-d|jsq-heap|msq-heap|jiq\n"
+	       "                           dispatch policy, power-two is jsq-d (msq)\n"
+	       "  --dispatch-d N           workers sampled per pick by jsq-d (%d)\n"
+	       "  --dispatch-live          run all the dispatch policies, SIGUSR1 switches to the next\n"
+	       "  --rebalance              hand packets off between dispatchers\n"
+	       "  --work-stealing          no dispatcher, workers poll the NIC and steal\n"
+	       "  --steal-nic              with --work-stealing, also steal from peer RX queues\n"
+	       "  --in-place-tx            build responses in the RX mbufs (zero copy)\n"
+	       "  --flow-filter            drop everything but requests in the NIC (rte_flow)\n"
+	       "  --port N                 DPDK port id (%u)\n"
+	       "  --long-workers N         reserve N workers for long requests (0, off)\n"
+	       "  --long-types T,T,...     req_types that are long (0xb,0xd,0xf)\n"
+	       "  --admit-max-queue N      reject requests for workers with N jobs (0, off)\n"
+	       "  --admit-max-quanta N     reject requests for workers with N quanta serviced (0, off)\n"
+	       "  --codel-target-us T      reject requests that queued over T us for an interval (0, off)\n"
+	       "  --codel-interval-us I    CoDel interval in us (%d)\n"
+	       "  --telemetry NAME         shared-memory segment of the counters (%s)\n"
+	       "  --latency-hist on|off    per job type latency histograms (off)\n"
+	       "  --adaptive-quantum       retune the quantum of each worker online\n"
+	       "  --quantum-min N          smallest adaptive quantum in cycles (%d)\n"
+	       "  --quantum-max N          largest adaptive quantum in cycles (%d)\n",
+	       prgname, NUM_WORKER_THREADS, NUM_WORKER_COROS, CORO_COOLDOWN_US, STACK_SIZE, NUM_DISPATCHERS, QUANTUM_CYCLE,
+	       QUANTUM_IC, DISPATCH_RING_SIZE, TX_DEQUEUE_PERIOD, SLO_US, DISPATCH_D, dpdk_port, CODEL_INTERVAL_US,
+	       TELEMETRY_SHM_NAME, QUANTUM_MIN_CYCLE, QUANTUM_MAX_CYCLE);
+}
+
+static int parse_int(const char *str, long min, long max, long *val)
+{
+	char *end;
+
+	if (str == nullptr)
+		return -EINVAL;
+	errno = 0;
+	*val = strtol(str, &end, 0);
+	if (errno != 0 || end == str || *end != '\0' || *val < min || *val > max)
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_bool(const char *str, bool *val)
+{
+	// flags given on the command line have no value
+	if (str == nullptr || !strcmp(str, "1") || !strcasecmp(str, "true") || !strcasecmp(str, "yes") || !strcasecmp(str, "on"))
+		*val = true;
+	else if (!strcmp(str, "0") || !strcasecmp(str, "false") || !strcasecmp(str, "no") || !strcasecmp(str, "off"))
+		*val = false;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+/* comma separated list of type:quantum:priority, see job_class_t */
+static int parse_job_classes(const char *str)
+{
+	char buf[256];
+	char *tok, *save, *quantum, *priority;
+	long t, q, p;
+
+	if (str == nullptr || strlen(str) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, str);
+	for (tok = strtok_r(buf, ",", &save); tok != nullptr; tok = strtok_r(nullptr, ",", &save)) {
+		if ((quantum = strchr(tok, ':')) == nullptr || (priority = strchr(quantum + 1, ':')) == nullptr)
+			return -EINVAL;
+		*quantum++ = '\0';
+		*priority++ = '\0';
+		if (parse_int(tok, 0, NUM_JOB_CLASSES - 1, &t) < 0 || parse_int(quantum, 0, INT_MAX, &q) < 0 ||
+		    parse_int(priority, 0, MLFQ_LEVELS - 1, &p) < 0)
+			return -EINVAL;
+		job_classes[t].quantum = q;
+		job_classes[t].priority = p;
+		job_classes[t].configured = true;
+	}
+	return 0;
+}
+
+/* comma separated list of type:slo_us */
+static int parse_class_slos(const char *str)
+{
+	char buf[256];
+	char *tok, *save, *slo;
+	long t, us;
+
+	if (str == nullptr || strlen(str) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, str);
+	for (tok = strtok_r(buf, ",", &save); tok != nullptr; tok = strtok_r(nullptr, ",", &save)) {
+		if ((slo = strchr(tok, ':')) == nullptr)
+			return -EINVAL;
+		*slo++ = '\0';
+		if (parse_int(tok, 0, NUM_JOB_CLASSES - 1, &t) < 0 || parse_int(slo, 1, INT_MAX, &us) < 0)
+			return -EINVAL;
+		job_classes[t].slo_us = us;
+	}
+	return 0;
+}
+
+/* comma separated list of request types, as a bit mask */
+static int parse_req_types(const char *str, uint64_t *types)
+{
+	char buf[256];
+	char *tok, *save;
+	long t;
+	uint64_t mask = 0;
+
+	if (str == nullptr || strlen(str) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, str);
+	for (tok = strtok_r(buf, ",", &save); tok != nullptr; tok = strtok_r(nullptr, ",", &save)) {
+		if (parse_int(tok, 0, 63, &t) < 0)
+			return -EINVAL;
+		mask |= 1ULL << t;
+	}
+	*types = mask;
+	return 0;
+}
+
+static int parse_config_file(const char *path);
+
+/*
+ * Apply one setting, given by its long option name
+ */
+static int apply_option(const char *name, const char *value)
 {
 	long tmp;
-	int next_arg;
+	int ret = 0;
+
+	if (!strcmp(name, "config")) {
+		ret = value? parse_config_file(value) : -EINVAL;
+	} else if (!strcmp(name, "workers")) {
+		if ((ret = parse_int(value, 1, RTE_MAX_LCORE, &tmp)) == 0)
+			num_worker_threads = tmp;
+	} else if (!strcmp(name, "coros")) {
+		if ((ret = parse_int(value, 1, 4096, &tmp)) == 0)
+			num_worker_coros = tmp;
+	} else if (!strcmp(name, "max-coros")) {
+		if ((ret = parse_int(value, 1, 4096, &tmp)) == 0)
+			max_worker_coros = tmp;
+	} else if (!strcmp(name, "coro-cooldown-us")) {
+		if ((ret = parse_int(value, 1, INT_MAX, &tmp)) == 0)
+			coro_cooldown_us = tmp;
+	} else if (!strcmp(name, "stack-size")) {
+		if ((ret = parse_int(value, 4096, 64 << 20, &tmp)) == 0 && tmp % 4096 != 0)
+			ret = -EINVAL;
+		if (ret == 0)
+			stack_size = tmp;
+	} else if (!strcmp(name, "dispatchers")) {
+		if ((ret = parse_int(value, 1, RTE_MAX_LCORE, &tmp)) == 0)
+			num_dispatchers = tmp;
+	} else if (!strcmp(name, "quantum-cycle")) {
+		if ((ret = parse_int(value, 1, INT_MAX, &tmp)) == 0)
+			quantum_cycle = tmp;
+	} else if (!strcmp(name, "quantum-ic")) {
+		if ((ret = parse_int(value, 1, INT_MAX, &tmp)) == 0)
+			quantum_ic = tmp;
+	} else if (!strcmp(name, "dispatch-ring-size")) {
+		if ((ret = parse_int(value, 2, RTE_RING_SZ_MASK, &tmp)) == 0 && !rte_is_power_of_2(tmp))
+			ret = -EINVAL;
+		if (ret == 0)
+			dispatch_ring_size = tmp;
+	} else if (!strcmp(name, "tx-dequeue-period")) {
+		if ((ret = parse_int(value, 1, UINT16_MAX, &tmp)) == 0)
+			tx_dequeue_period = tmp;
+	} else if (!strcmp(name, "sched")) {
+		if (value && !strcmp(value, "ps"))
+			sched_policy = SCHED_PS;
+		else if (value && !strcmp(value, "fcfs"))
+			sched_policy = SCHED_FCFS;
+		else if (value && !strcmp(value, "las"))
+			sched_policy = SCHED_LAS;
+		else if (value && !strcmp(value, "mlfq"))
+			sched_policy = SCHED_MLFQ;
+		else if (value && !strcmp(value, "edf"))
+			sched_policy = SCHED_EDF;
+		else
+			ret = -EINVAL;
+	} else if (!strcmp(name, "dispatch")) {
+		ret = -EINVAL;
+		for (int p = 0; value && p < NUM_DISPATCH_POLICIES; p++) {
+			if (!strcmp(value, dispatch_policy_names[p])) {
+				dispatch_policy = (dispatch_policy_t)p;
+				ret = 0;
+			}
+		}
+		if (value && !strcmp(value, "power-two")) {
+			dispatch_policy = DISPATCH_JSQ_D;
+			ret = 0;
+		}
+	} else if (!strcmp(name, "dispatch-d")) {
+		if ((ret = parse_int(value, 1, 64, &tmp)) == 0)
+			dispatch_d = tmp;
+	} else if (!strcmp(name, "dispatch-live")) {
+		ret = parse_bool(value, &dispatch_live);
+	} else if (!strcmp(name, "rebalance")) {
+		ret = parse_bool(value, &dispatcher_rebalance);
+	} else if (!strcmp(name, "work-stealing")) {
+		ret = parse_bool(value, &work_stealing);
+	} else if (!strcmp(name, "steal-nic")) {
+		ret = parse_bool(value, &steal_nic_queue);
+	} else if (!strcmp(name, "in-place-tx")) {
+		ret = parse_bool(value, &in_place_tx);
+	} else if (!strcmp(name, "flow-filter")) {
+		ret = parse_bool(value, &flow_filter);
+	} else if (!strcmp(name, "long-workers")) {
+		if ((ret = parse_int(value, 0, RTE_MAX_LCORE, &tmp)) == 0)
+			num_long_workers = tmp;
+	} else if (!strcmp(name, "long-types")) {
+		ret = parse_req_types(value, &long_req_types);
+	} else if (!strcmp(name, "admit-max-queue")) {
+		if ((ret = parse_int(value, 0, INT_MAX, &tmp)) == 0)
+			admit_max_queue = tmp;
+	} else if (!strcmp(name, "admit-max-quanta")) {
+		if ((ret = parse_int(value, 0, INT_MAX, &tmp)) == 0)
+			admit_max_quanta = tmp;
+	} else if (!strcmp(name, "codel-target-us")) {
+		if ((ret = parse_int(value, 0, UINT_MAX, &tmp)) == 0)
+			codel_target_us = tmp;
+	} else if (!strcmp(name, "codel-interval-us")) {
+		if ((ret = parse_int(value, 1, UINT_MAX, &tmp)) == 0)
+			codel_interval_us = tmp;
+	} else if (!strcmp(name, "class")) {
+		ret = parse_job_classes(value);
+	} else if (!strcmp(name, "slo-us")) {
+		if ((ret = parse_int(value, 1, INT_MAX, &tmp)) == 0)
+			slo_us = tmp;
+	} else if (!strcmp(name, "class-slo")) {
+		ret = parse_class_slos(value);
+	} else if (!strcmp(name, "edf-shed")) {
+		ret = parse_bool(value, &edf_shed);
+	} else if (!strcmp(name, "adaptive-quantum")) {
+		ret = parse_bool(value, &adaptive_quantum);
+	} else if (!strcmp(name, "quantum-min")) {
+		if ((ret = parse_int(value, 1, INT_MAX, &tmp)) == 0)
+			quantum_min = tmp;
+	} else if (!strcmp(name, "quantum-max")) {
+		if ((ret = parse_int(value, 1, INT_MAX, &tmp)) == 0)
+			quantum_max = tmp;
+	} else if (!strcmp(name, "latency-hist")) {
+		ret = parse_bool(value, &latency_hist);
+	} else if (!strcmp(name, "telemetry")) {
+		// a POSIX shared memory name is a single "/name" component
+		if (value && value[0] == '/' && strchr(value + 1, '/') == nullptr && strlen(value) < sizeof(telemetry_name))
+			strcpy(telemetry_name, value);
+		else
+			ret = -EINVAL;
+	} else if (!strcmp(name, "port")) {
+		if ((ret = parse_int(value, 0, RTE_MAX_ETHPORTS - 1, &tmp)) == 0)
+			dpdk_port = tmp;
+	} else {
+		printf("unknown option: %s\n", name);
+		return -EINVAL;
+	}
+
+	if (ret < 0)
+		printf("invalid value for %s: %s\n", name, value? value : "(none)");
+	return ret;
+}
+
+/*
+ * Read "key = value" lines, keys are the long option names; '#' starts a comment
+ */
+static int parse_config_file(const char *path)
+{
+	char line[256];
+	char *key, *value, *end;
+	int lineno = 0, ret = 0;
+	FILE *f = fopen(path, "r");
+
+	if (f == nullptr) {
+		printf("cannot open config file %s\n", path);
+		return -EINVAL;
+	}
+	while (ret == 0 && fgets(line, sizeof(line), f) != nullptr) {
+		lineno++;
+		if ((end = strchr(line, '#')) != nullptr)
+			*end = '\0';
+		key = line + strspn(line, " \t\r\n");
+		if (*key == '\0')
+			continue;
+		value = strchr(key, '=');
+		if (value != nullptr) {
+			*value++ = '\0';
+			value += strspn(value, " \t");
+			for (end = value + strlen(value); end > value && isspace(end[-1]); end--);
+			*end = '\0';
+		}
+		for (end = key + strlen(key); end > key && isspace(end[-1]); end--);
+		*end = '\0';
+		ret = apply_option(key, value);
+		if (ret < 0)
+			printf("%s:%d: bad setting\n", path, lineno);
+	}
+	fclose(f);
+	return ret;
+}
+
+static int parse_args(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"config", required_argument, nullptr, 0},
+		{"workers", required_argument, nullptr, 0},
+		{"coros", required_argument, nullptr, 0},
+		{"max-coros", required_argument, nullptr, 0},
+		{"coro-cooldown-us", required_argument, nullptr, 0},
+		{"stack-size", required_argument, nullptr, 0},
+		{"dispatchers", required_argument, nullptr, 0},
+		{"quantum-cycle", required_argument, nullptr, 0},
+		{"quantum-ic", required_argument, nullptr, 0},
+		{"dispatch-ring-size", required_argument, nullptr, 0},
+		{"tx-dequeue-period", required_argument, nullptr, 0},
+		{"sched", required_argument, nullptr, 0},
+		{"class", required_argument, nullptr, 0},
+		{"slo-us", required_argument, nullptr, 0},
+		{"class-slo", required_argument, nullptr, 0},
+		{"edf-shed", no_argument, nullptr, 0},
+		{"dispatch", required_argument, nullptr, 0},
+		{"dispatch-d", required_argument, nullptr, 0},
+		{"dispatch-live", no_argument, nullptr, 0},
+		{"rebalance", no_argument, nullptr, 0},
+		{"work-stealing", no_argument, nullptr, 0},
+		{"steal-nic", no_argument, nullptr, 0},
+		{"in-place-tx", no_argument, nullptr, 0},
+		{"flow-filter", no_argument, nullptr, 0},
+		{"port", required_argument, nullptr, 0},
+		{"long-workers", required_argument, nullptr, 0},
+		{"long-types", required_argument, nullptr, 0},
+		{"admit-max-queue", required_argument, nullptr, 0},
+		{"admit-max-quanta", required_argument, nullptr, 0},
+		{"codel-target-us", required_argument, nullptr, 0},
+		{"codel-interval-us", required_argument, nullptr, 0},
+		{"telemetry", required_argument, nullptr, 0},
+		{"latency-hist", required_argument, nullptr, 0},
+		{"adaptive-quantum", no_argument, nullptr, 0},
+		{"quantum-min", required_argument, nullptr, 0},
+		{"quantum-max", required_argument, nullptr, 0},
+		{nullptr, 0, nullptr, 0}
+	};
+	int opt, option_index;
 
 	/* argv[0] is still the program name */
-	if (argc != 2 ) {
-		printf("invalid number of arguments: %d\n", argc);
+	optind = 1;
+	while ((opt = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+		if (opt != 0 || apply_option(long_options[option_index].name, optarg) < 0) {
+			usage(argv[0]);
+			return -EINVAL;
+		}
+	}
+
+	if (argc - optind != 1) {
+		printf("invalid number of arguments: %d\n", argc - optind);
+		usage(argv[0]);
+		return -EINVAL;
+	}
+	if (str_to_ip(argv[optind], &my_ip) < 0) {
+		printf("invalid server ip: %s\n", argv[optind]);
 		return -EINVAL;
 	}
-	str_to_ip(argv[1], &my_ip);
 	return 0;
 }
 
-/* perform basic sanity check of the settings */
-static void sanity_check()
+/* smallest 2^k - 1 (the optimal mempool size) that holds n mbufs */
+static unsigned int mbuf_pool_size_for(uint64_t n, unsigned int min_size)
+{
+	uint64_t size = min_size;
+	while (size <= n)
+		size = size * 2 + 1;
+	return size;
+}
+
+/* perform basic sanity check of the settings and derive the dependent ones */
+static int sanity_check()
 {	
-	assert(RX_MBUF_POOL_SIZE > NUM_WORKER_THREADS * MAX_NUM_RX_MBUF_PER_THREAD);
-	assert(TX_MBUF_POOL_SIZE > NUM_WORKER_THREADS * MAX_NUM_TX_MBUF_PER_THREAD);
 	#if defined(SERVER_LAT) && defined(QUEUE_SIZE)
-	assert(false);
+	printf("error: SERVER_LAT and QUEUE_SIZE both use the run_ns field\n");
+	return -EINVAL;
+	#endif
+	if (num_dispatchers > num_worker_threads) {
+		printf("error: more dispatchers (%d) than workers (%d)\n", num_dispatchers, num_worker_threads);
+		return -EINVAL;
+	}
+	if (dispatcher_rebalance && num_dispatchers == 1) {
+		printf("error: --rebalance needs more than one dispatcher\n");
+		return -EINVAL;
+	}
+	if (steal_nic_queue && !work_stealing) {
+		printf("error: --steal-nic needs --work-stealing\n");
+		return -EINVAL;
+	}
+	// workers free their own mbufs in the dispatcher-free mode
+	#ifndef NEW_DISPATCHER
+	if (work_stealing) {
+		printf("error: --work-stealing needs a build with NEW_DISPATCHER\n");
+		return -EINVAL;
+	}
+	#endif
+	// the TX queues of the workers return RX mbufs to the pool
+	#ifndef NEW_DISPATCHER
+	if (in_place_tx) {
+		printf("error: --in-place-tx needs a build with NEW_DISPATCHER\n");
+		return -EINVAL;
+	}
 	#endif
+	if (num_long_workers > 0) {
+		if (work_stealing) {
+			printf("error: --long-workers needs dispatchers, not --work-stealing\n");
+			return -EINVAL;
+		}
+		// each dispatcher needs both pools
+		if (num_long_workers < num_dispatchers || num_worker_threads - num_long_workers < num_dispatchers) {
+			printf("error: --long-workers must leave every dispatcher at least one short and one long worker\n");
+			return -EINVAL;
+		}
+	}
+	if (work_stealing && num_worker_threads < 2) {
+		printf("error: --work-stealing needs at least two workers\n");
+		return -EINVAL;
+	}
+	if (work_stealing && (admit_max_queue > 0 || admit_max_quanta > 0)) {
+		printf("error: --admit-max-queue and --admit-max-quanta are checked by dispatchers, not with --work-stealing\n");
+		return -EINVAL;
+	}
+	if (adaptive_quantum) {
+		if (sched_policy == SCHED_FCFS) {
+			printf("error: --adaptive-quantum needs a preemptive --sched\n");
+			return -EINVAL;
+		}
+		// both would write the CI threshold
+		if (sched_policy == SCHED_MLFQ) {
+			printf("error: --adaptive-quantum and --sched mlfq both set the quantum\n");
+			return -EINVAL;
+		}
+		if (quantum_min > quantum_max || quantum_cycle < quantum_min || quantum_cycle > quantum_max) {
+			printf("error: need --quantum-min <= --quantum-cycle <= --quantum-max\n");
+			return -EINVAL;
+		}
+	}
+	if (max_worker_coros == 0)
+		max_worker_coros = num_worker_coros;
+	if (max_worker_coros < num_worker_coros) {
+		printf("error: --max-coros (%d) is below --coros (%d)\n", max_worker_coros, num_worker_coros);
+		return -EINVAL;
+	}
+	if (edf_shed && sched_policy != SCHED_EDF) {
+		printf("error: --edf-shed needs --sched edf\n");
+		return -EINVAL;
+	}
+	// the rejected RX mbufs go out as responses from the worker
+	#ifndef NEW_DISPATCHER
+	if (codel_target_us > 0) {
+		printf("error: --codel-target-us needs a build with NEW_DISPATCHER\n");
+		return -EINVAL;
+	}
+	#endif
+
+	tsc_cycles_per_us = rte_get_tsc_hz() / US_PER_S;
+	for (int t = 0; t < NUM_JOB_CLASSES; t++) {
+		if (!job_classes[t].configured) {
+			job_classes[t].quantum = quantum_cycle;
+			job_classes[t].priority = 0;
+		}
+		job_classes[t].slo_cycles = (uint64_t)(job_classes[t].slo_us? job_classes[t].slo_us : slo_us) * tsc_cycles_per_us;
+	}
 
+	num_rx_queues = work_stealing? num_worker_threads : num_dispatchers;
+	num_tx_queues = num_worker_threads;
+	// dispatchers send their rejections themselves
+	if (admit_max_queue > 0 || admit_max_quanta > 0)
+		num_tx_queues += num_dispatchers;
+	codel_target_cycles = (uint64_t)codel_target_us * rte_get_tsc_hz() / US_PER_S;
+	codel_interval_cycles = (uint64_t)codel_interval_us * rte_get_tsc_hz() / US_PER_S;
+	coro_cooldown_cycles = (uint64_t)coro_cooldown_us * rte_get_tsc_hz() / US_PER_S;
+	#ifdef SERVER_LAT
+	stamp_arrivals = true;
+	#else
+	stamp_arrivals = codel_target_cycles > 0 || latency_hist || sched_policy == SCHED_EDF;
+	#endif
+	rx_queue_burst_size = num_worker_threads * MAX_DISPATCH_UNIT;
+	rx_mbuf_pool_size = mbuf_pool_size_for((uint64_t)num_worker_threads * (MAX_NUM_RX_MBUF_PER_THREAD + (in_place_tx? TX_RING_SIZE : 0)), RX_MBUF_POOL_SIZE);
+	tx_mbuf_pool_size = mbuf_pool_size_for((uint64_t)num_worker_threads * MAX_NUM_TX_MBUF_PER_THREAD, TX_MBUF_POOL_SIZE);
+	if (rx_mbuf_pool_size != RX_MBUF_POOL_SIZE || tx_mbuf_pool_size != TX_MBUF_POOL_SIZE)
+		printf("growing mbuf pools to %u RX and %u TX mbufs\n", rx_mbuf_pool_size, tx_mbuf_pool_size);
+
+	printf("%zu-byte coroutine stacks%s\n", stack_size, STACK_GUARD_SIZE? " with guard pages" : "");
+	printf("%d workers x %d coros, %d dispatchers, quantum %d cycles / %d IR instructions, sched %s, dispatch %s%s%s%s%s\n",
+	       num_worker_threads, num_worker_coros, num_dispatchers, quantum_cycle, quantum_ic,
+	       sched_policy == SCHED_LAS? "las" : sched_policy == SCHED_FCFS? "fcfs" : sched_policy == SCHED_MLFQ? "mlfq" :
+	       sched_policy == SCHED_EDF? "edf" : "ps",
+	       dispatch_policy_names[dispatch_policy],
+	       dispatcher_rebalance? ", rebalance" : "", work_stealing? ", work stealing" : "",
+	       steal_nic_queue? ", steal nic" : "", in_place_tx? ", in-place tx" : "");
+	if (dispatch_policy == DISPATCH_JSQ_D || dispatch_live)
+		printf("jsq-d samples %d workers per pick\n", dispatch_d);
+	if (dispatch_live)
+		printf("live dispatch: kill -USR1 %d switches to the next policy\n", (int)getpid());
+	if (num_long_workers > 0)
+		printf("%d workers reserved for long request types 0x%" PRIx64 "\n", num_long_workers, long_req_types);
+	if (admit_max_queue > 0 || admit_max_quanta > 0)
+		printf("rejecting requests for workers with %d jobs or %d quanta serviced (0 is no limit)\n", admit_max_queue, admit_max_quanta);
+	if (sched_policy == SCHED_MLFQ) {
+		for (int t = 0; t < NUM_JOB_CLASSES; t++) {
+			if (job_classes[t].configured)
+				printf("req_type 0x%x: quantum %" PRIu64 " cycles%s, priority %d\n", t, job_classes[t].quantum,
+				       job_classes[t].quantum? "" : " (to completion)", job_classes[t].priority);
+		}
+	}
+	if (sched_policy == SCHED_EDF) {
+		printf("default SLO %u us%s\n", slo_us, edf_shed? ", shedding jobs past their deadline" : "");
+		for (int t = 0; t < NUM_JOB_CLASSES; t++) {
+			if (job_classes[t].slo_us)
+				printf("req_type 0x%x: SLO %u us\n", t, job_classes[t].slo_us);
+		}
+	}
+	if (max_worker_coros > num_worker_coros)
+		printf("growing workers up to %d coroutines, retiring the extra ones after %u us idle\n", max_worker_coros, coro_cooldown_us);
+	if (adaptive_quantum)
+		printf("adaptive quantum between %d and %d cycles\n", quantum_min, quantum_max);
+	if (codel_target_us > 0)
+		printf("rejecting requests above a %u us queueing delay for %u us\n", codel_target_us, codel_interval_us);
+	return 0;
 }
 /*
  * The main function, which does initialization and starts the client or server.
@@ -1332,14 +3292,8 @@ static void sanity_check()
 
 int main(int argc, char *argv[])
 {
-	sanity_check();
-
 	int args_parsed, res;
 
-	#ifdef STACKS_FROM_HUGEPAGE
- 	stacks = allocate_stacks_from_hugepages();
- 	#endif
-
 	rocksdb_init();
 	
 	/* Initialize dpdk. */
@@ -1351,6 +3305,15 @@ int main(int argc, char *argv[])
 	res = parse_args(argc, argv);
 	if (res < 0)
 		return 0;
+	if (sanity_check() < 0)
+		return 0;
+
+	/* Check that there is a port to send/receive on. */
+	if (!rte_eth_dev_is_valid_port(dpdk_port))
+		rte_exit(EXIT_FAILURE, "Error: port is not available\n");
+
+	mbuf_pool_init();
+	telemetry_init();
 
 	/* set thread id */
 	cp_pid = gettid();
@@ -1358,6 +3321,7 @@ int main(int argc, char *argv[])
 	/* initialize port */
 	if (port_init(dpdk_port, rx_mbuf_pool, num_rx_queues, num_tx_queues) != 0)
 		rte_exit(EXIT_FAILURE, "Cannot init port %d\n", dpdk_port);
+	init_rx_filter();
 
 	//rocksdb_init();
 	run_server();
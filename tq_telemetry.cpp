@@ -0,0 +1,252 @@
+/*
+ * Reader of the tq_server counters exported in shared memory (telemetry.h).
+ * Samples them at a fixed rate and prints per-second rates, gauge averages
+ * and per job type breakdowns; the server is never blocked or slowed down.
+ * With -l it prints latency percentiles per job type instead, merged from the
+ * histograms of all workers over each print period; -o prints them once,
+ * over the whole run, and exits.
+ *
+ * usage: ./tq_telemetry [-n name] [-r sample_hz] [-p print_ms] [-l | -o]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "telemetry.h"
+
+#define DEFAULT_SAMPLE_HZ 1000
+#define DEFAULT_PRINT_MS 1000
+
+#define WORKER_WORDS (sizeof(struct worker_telemetry) / sizeof(uint64_t))
+#define DISPATCHER_WORDS (sizeof(struct dispatcher_telemetry) / sizeof(uint64_t))
+
+/* gauges of one worker over a print period */
+struct gauge_stats {
+	uint64_t ring_sum, ring_max, busy_sum, coros_sum;
+};
+
+static const struct telemetry_hdr *map_telemetry(const char *name)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		printf("cannot open %s: %s, is tq_server running?\n", name, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct telemetry_hdr)) {
+		printf("%s is not a telemetry segment\n", name);
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		printf("cannot map %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	const struct telemetry_hdr *hdr = (const struct telemetry_hdr *) p;
+	// the server fills the header before it publishes the magic
+	while (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC)
+		usleep(1000);
+	if (hdr->num_job_types != TELEMETRY_NUM_JOB_TYPES ||
+	    (uint64_t)st.st_size < telemetry_size(hdr->num_workers, hdr->num_dispatchers)) {
+		printf("%s was written by another version of tq_server\n", name);
+		return NULL;
+	}
+	return hdr;
+}
+
+static void snapshot(const struct telemetry_hdr *hdr, uint64_t *workers, uint64_t *dispatchers)
+{
+	const uint64_t *src = (const uint64_t *) telemetry_workers(hdr);
+	for (size_t i = 0; i < hdr->num_workers * WORKER_WORDS; i++)
+		workers[i] = telemetry_read(&src[i]);
+	src = (const uint64_t *) telemetry_dispatchers(hdr);
+	for (size_t i = 0; i < hdr->num_dispatchers * DISPATCHER_WORDS; i++)
+		dispatchers[i] = telemetry_read(&src[i]);
+}
+
+static void timespec_add_ns(struct timespec *t, long ns)
+{
+	t->tv_nsec += ns;
+	while (t->tv_nsec >= 1000000000L) {
+		t->tv_nsec -= 1000000000L;
+		t->tv_sec++;
+	}
+}
+
+static void print_period(const struct telemetry_hdr *hdr, double secs, long num_samples,
+	const struct worker_telemetry *cur, const struct worker_telemetry *prev,
+	const struct dispatcher_telemetry *dcur, const struct dispatcher_telemetry *dprev,
+	const struct gauge_stats *gauges)
+{
+	uint64_t completions[TELEMETRY_NUM_JOB_TYPES] = {0}, preemptions[TELEMETRY_NUM_JOB_TYPES] = {0};
+	uint64_t quanta[TELEMETRY_NUM_JOB_TYPES] = {0};
+	uint32_t w, d, t, s;
+
+	printf("---- %.3f s, %ld samples\n", secs, num_samples);
+	printf("worker      rx/s      tx/s   drops rejects  ring avg/max   busy/coros  quantum  stack KB  run/fetch/tx/return cycles\n");
+	for (w = 0; w < hdr->num_workers; w++) {
+		uint64_t nb_stage = cur[w].stage_samples - prev[w].stage_samples;
+		printf("%6u %9.0f %9.0f %7lu %7lu %7.1f/%-5lu %6.1f/%-5.1f %8lu %9lu ", w,
+		       (cur[w].rx_pkts - prev[w].rx_pkts) / secs, (cur[w].tx_pkts - prev[w].tx_pkts) / secs,
+		       cur[w].drops - prev[w].drops, cur[w].rejects - prev[w].rejects,
+		       (double)gauges[w].ring_sum / num_samples, gauges[w].ring_max,
+		       (double)gauges[w].busy_sum / num_samples, (double)gauges[w].coros_sum / num_samples,
+		       cur[w].quantum_cycles, cur[w].stack_used / 1024);
+		for (s = 0; s < TELEMETRY_NUM_STAGES; s++)
+			printf("%s%lu", s? "/" : " ", nb_stage? (cur[w].stage_cycles[s] - prev[w].stage_cycles[s]) / nb_stage : 0);
+		printf("\n");
+		for (t = 0; t < TELEMETRY_NUM_JOB_TYPES; t++) {
+			completions[t] += cur[w].completions[t] - prev[w].completions[t];
+			preemptions[t] += cur[w].preemptions[t] - prev[w].preemptions[t];
+			quanta[t] += cur[w].quanta[t] - prev[w].quanta[t];
+		}
+	}
+
+	printf("type     done/s  preempt/s  quanta/job\n");
+	for (t = 0; t < TELEMETRY_NUM_JOB_TYPES; t++) {
+		if (completions[t] == 0 && preemptions[t] == 0)
+			continue;
+		printf("0x%-4x %9.0f  %9.0f  %10.2f\n", t, completions[t] / secs, preemptions[t] / secs,
+		       completions[t]? (double)quanta[t] / completions[t] : 0.0);
+	}
+
+	if (hdr->num_dispatchers > 0)
+		printf("dispatcher  rx/s  dispatched/s   drops rejects handoffs\n");
+	for (d = 0; d < hdr->num_dispatchers; d++) {
+		printf("%6u %9.0f %13.0f %7lu %7lu %8lu\n", d,
+		       (dcur[d].rx_pkts - dprev[d].rx_pkts) / secs, (dcur[d].dispatched - dprev[d].dispatched) / secs,
+		       dcur[d].drops - dprev[d].drops, dcur[d].rejects - dprev[d].rejects,
+		       dcur[d].handoffs - dprev[d].handoffs);
+	}
+	fflush(stdout);
+}
+
+static void print_latency(const struct telemetry_hdr *hdr, const struct worker_telemetry *cur,
+	const struct worker_telemetry *prev)
+{
+	static const char *metric_names[LAT_NUM_METRICS] = {"queueing us", "service us", "quanta", "sojourn us"};
+	static const double quantiles[] = {0.5, 0.99, 0.999};
+	std::vector<uint64_t> merged(HIST_NUM_BUCKETS);
+	double us_per_cycle = 1e6 / hdr->tsc_hz;
+	uint64_t total;
+
+	printf("type   metric          count        p50        p99      p99.9\n");
+	for (uint32_t t = 0; t < TELEMETRY_NUM_JOB_TYPES; t++) {
+		for (uint32_t m = 0; m < LAT_NUM_METRICS; m++) {
+			total = 0;
+			for (uint32_t b = 0; b < HIST_NUM_BUCKETS; b++) {
+				merged[b] = 0;
+				for (uint32_t w = 0; w < hdr->num_workers; w++)
+					merged[b] += cur[w].hists[t][m].counts[b] - (prev? prev[w].hists[t][m].counts[b] : 0);
+				total += merged[b];
+			}
+			// every completion is in all of them
+			if (total == 0)
+				break;
+			printf("0x%-4x %-12s %8lu", t, metric_names[m], total);
+			for (double q : quantiles) {
+				uint64_t v = hist_quantile(merged.data(), total, q);
+				if (m == LAT_QUANTA)
+					printf(" %10lu", v);
+				else
+					printf(" %10.2f", v * us_per_cycle);
+			}
+			printf("\n");
+		}
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = TELEMETRY_SHM_NAME;
+	long sample_hz = DEFAULT_SAMPLE_HZ, print_ms = DEFAULT_PRINT_MS;
+	bool latency = false, once = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:p:lo")) != -1) {
+		switch (opt) {
+		case 'n': name = optarg; break;
+		case 'r': sample_hz = atol(optarg); break;
+		case 'p': print_ms = atol(optarg); break;
+		case 'l': latency = true; break;
+		case 'o': once = true; break;
+		default:
+			printf("usage: %s [-n name] [-r sample_hz] [-p print_ms] [-l | -o]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (sample_hz <= 0 || sample_hz > 1000000 || print_ms <= 0) {
+		printf("invalid sample rate or print period\n");
+		return 1;
+	}
+
+	const struct telemetry_hdr *hdr = map_telemetry(name);
+	if (hdr == NULL)
+		return 1;
+	if (!once)
+		printf("%u workers, %u dispatchers, sampling at %ld Hz\n", hdr->num_workers, hdr->num_dispatchers, sample_hz);
+
+	// two snapshots of the counters, at the start and the end of a print period
+	std::vector<struct worker_telemetry> workers[2] = {
+		std::vector<struct worker_telemetry>(hdr->num_workers), std::vector<struct worker_telemetry>(hdr->num_workers)};
+	std::vector<struct dispatcher_telemetry> dispatchers[2] = {
+		std::vector<struct dispatcher_telemetry>(hdr->num_dispatchers), std::vector<struct dispatcher_telemetry>(hdr->num_dispatchers)};
+	std::vector<struct gauge_stats> gauges(hdr->num_workers);
+	const struct worker_telemetry *live = telemetry_workers(hdr);
+	long period_ns = 1000000000L / sample_hz, samples_per_print = (print_ms * sample_hz + 999) / 1000;
+	long num_samples = 0;
+	int cur = 0;
+	struct timespec next, start, now;
+
+	snapshot(hdr, (uint64_t *) workers[cur].data(), (uint64_t *) dispatchers[cur].data());
+	if (once) {
+		print_latency(hdr, workers[cur].data(), NULL);
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	start = next;
+	for (;;) {
+		timespec_add_ns(&next, period_ns);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		// gauges are sampled every tick, counters only need the period ends
+		for (uint32_t w = 0; w < hdr->num_workers; w++) {
+			uint64_t ring = telemetry_read(&live[w].ring_occupancy);
+			gauges[w].ring_sum += ring;
+			if (ring > gauges[w].ring_max)
+				gauges[w].ring_max = ring;
+			gauges[w].busy_sum += telemetry_read(&live[w].busy_coros);
+			gauges[w].coros_sum += telemetry_read(&live[w].coros);
+		}
+		if (++num_samples < samples_per_print)
+			continue;
+
+		snapshot(hdr, (uint64_t *) workers[!cur].data(), (uint64_t *) dispatchers[!cur].data());
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (latency)
+			print_latency(hdr, workers[!cur].data(), workers[cur].data());
+		else
+			print_period(hdr, (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9, num_samples,
+		             workers[!cur].data(), workers[cur].data(), dispatchers[!cur].data(), dispatchers[cur].data(),
+		             gauges.data());
+		cur = !cur;
+		start = now;
+		num_samples = 0;
+		memset(gauges.data(), 0, gauges.size() * sizeof(struct gauge_stats));
+	}
+	return 0;
+}